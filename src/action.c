@@ -86,6 +86,11 @@ static int default_function(const action_t *a, astack_t *s)
         func(stack_get_p(s, 0),
              stack_get_i(s, 1),
              stack_get_i(s, 2));
+    } else if (strcmp(a->csig, "vpiii") == 0) {
+        func(stack_get_p(s, 0),
+             stack_get_i(s, 1),
+             stack_get_i(s, 2),
+             stack_get_i(s, 3));
     } else {
         LOG_E("Cannot handle sig '%s'", a->csig);
         assert(false);
@@ -102,6 +107,7 @@ int action_execv(const action_t *action, const char *sig, va_list ap)
     char c;
     bool b;
     int i, nb;
+    int64_t t0 = get_clock();
     int (*func)(const action_t *a, astack_t *s);
     astack_t *s = stack_create();
     func = action->func ?: default_function;
@@ -148,6 +154,7 @@ int action_execv(const action_t *action, const char *sig, va_list ap)
         goxel_update_meshes(goxel, -1);
     }
     stack_delete(s);
+    profiler_trace_event(action->id, "action", t0, get_clock());
     return 0;
 }
 
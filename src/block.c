@@ -42,10 +42,6 @@
  *
  */
 
-// Implemented in marchingcube.c
-int block_generate_vertices_mc(const block_data_t *data, int effects,
-                               voxel_vertex_t *out);
-
 static const int N = BLOCK_SIZE;
 
 #define BLOCK_ITER(x, y, z) \
@@ -58,21 +54,34 @@ static const int N = BLOCK_SIZE;
         for (y = 1; y < N - 1; y++) \
             for (x = 1; x < N - 1; x++)
 
-#define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
+#define DATA_AT(d, x, y, z) ((d)->voxels[(x) + (y) * N + (z) * N * N])
 #define BLOCK_AT(c, x, y, z) (DATA_AT(c->data, x, y, z))
 
 static block_data_t *get_empty_data(void)
 {
     static block_data_t *data = NULL;
+    block_data_t *new_data;
     if (!data) {
-        data = calloc(1, sizeof(*data));
-        data->ref = 1;
-        data->id = 0;
-        goxel->block_count++;
+        new_data = calloc(1, sizeof(*data));
+        new_data->ref = 1;
+        new_data->id = 0;
+        if (__sync_bool_compare_and_swap(&data, NULL, new_data))
+            __sync_add_and_fetch(&goxel->block_count, 1);
+        else
+            free(new_data);
     }
     return data;
 }
 
+// Release a reference to a block data.
+static void data_release(block_data_t *data)
+{
+    if (__sync_sub_and_fetch(&data->ref, 1) == 0) {
+        free(data);
+        __sync_sub_and_fetch(&goxel->block_count, 1);
+    }
+}
+
 bool block_is_empty(const block_t *block, bool fast)
 {
     int x, y, z;
@@ -91,17 +100,13 @@ block_t *block_new(const vec3i_t *pos, block_data_t *data)
     block_t *block = calloc(1, sizeof(*block));
     block->pos = *pos;
     block->data = data ?: get_empty_data();
-    block->data->ref++;
+    __sync_add_and_fetch(&block->data->ref, 1);
     return block;
 }
 
 void block_delete(block_t *block)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-        goxel->block_count--;
-    }
+    data_release(block->data);
     free(block);
 }
 
@@ -110,19 +115,15 @@ block_t *block_copy(const block_t *other)
     block_t *block = malloc(sizeof(*block));
     *block = *other;
     memset(&block->hh, 0, sizeof(block->hh));
-    block->data->ref++;
+    __sync_add_and_fetch(&block->data->ref, 1);
     return block;
 }
 
 void block_set_data(block_t *block, block_data_t *data)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-        goxel->block_count--;
-    }
+    __sync_add_and_fetch(&data->ref, 1);
+    data_release(block->data);
     block->data = data;
-    data->ref++;
 }
 
 box_t block_get_box(const block_t *block, bool exact)
@@ -151,60 +152,22 @@ box_t block_get_box(const block_t *block, bool exact)
     return ret;
 }
 
-static uint32_t block_get_neighboors(const block_data_t *data,
-                                    int x, int y, int z,
-                                    uint8_t neighboors[27])
-{
-    int xx, yy, zz, i = 0;
-    vec3b_t npos;
-    uint32_t ret = 0;
-#define ITER_NEIGHBORS(x, y, z)         \
-     for (z = -1; z <= 1; z++)           \
-         for (y = -1; y <= 1; y++)       \
-             for (x = -1; x <= 1; x++)
-    ITER_NEIGHBORS(xx, yy, zz) {
-        npos = vec3b(x + xx, y + yy, z + zz);
-        neighboors[i] = DATA_AT(data, npos.x, npos.y, npos.z).a;
-        if (neighboors[i] >= 127) ret |= 1 << i;
-        i++;
-    }
-#undef ITER_NEIGHBORS
-    return ret;
-}
-
-static bool block_is_face_visible(uint32_t neighboors_mask, int f)
+// Sum of the positions of the solid neighbors weighted by their alpha.  The
+// smooth normal of a voxel is the opposite of it.
+static void block_get_normal_sum(const block_data_t *data,
+                                 int x, int y, int z, int s[3])
 {
-#define M(x, y, z) (1 << ((x + 1) + (y + 1) * 3 + (z + 1) * 9))
-    static const uint32_t MASKS[6] = {
-        M(0, -1, 0), M(0, +1, 0), M(0, 0, -1),
-        M(0, 0, +1), M(+1, 0, 0), M(-1, 0, 0),
-    };
-#undef M
-    return !(MASKS[f] & neighboors_mask);
-}
-
-static vec3b_t block_get_normal(uint32_t neighboors_mask,
-                                const uint8_t neighboors[27], int f,
-                                bool smooth)
-{
-    int x, y, z, i = 0;
-    int sx = 0, sy = 0, sz = 0;
-    int smax;
-    if (!smooth) return FACES_NORMALS[f];
-    for (z = -1; z <= +1; z++)
-    for (y = -1; y <= +1; y++)
-    for (x = -1; x <= +1; x++) {
-        if (neighboors_mask & (1 << i)) {
-            sx -= neighboors[i] * x;
-            sy -= neighboors[i] * y;
-            sz -= neighboors[i] * z;
-        }
-        i++;
+    int xx, yy, zz, a;
+    s[0] = s[1] = s[2] = 0;
+    for (zz = -1; zz <= +1; zz++)
+    for (yy = -1; yy <= +1; yy++)
+    for (xx = -1; xx <= +1; xx++) {
+        a = DATA_AT(data, x + xx, y + yy, z + zz).a;
+        if (a < 127) continue;
+        s[0] += a * xx;
+        s[1] += a * yy;
+        s[2] += a * zz;
     }
-    if (sx == 0 && sy == 0 && sz == 0)
-        return FACES_NORMALS[f];
-    smax = max(abs(sx), max(abs(sy), abs(sz)));
-    return vec3b(sx * 127 / smax, sy * 127 / smax, sz * 127 / smax);
 }
 
 static bool block_get_edge_border(uint32_t neighboors_mask, int f, int e)
@@ -296,61 +259,444 @@ static uint8_t block_get_border_mask(uint32_t neighboors_mask,
 #undef M
 }
 
-/* Packing of block id, pos, and face:
+// Pack four bytes in a word, with the same layout as the 4 bytes aligned
+// fields of voxel_vertex_t.
+static inline uint32_t pack_bytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    const uint8_t v[4] = {a, b, c, d};
+    uint32_t ret;
+    memcpy(&ret, v, sizeof(ret));
+    return ret;
+}
+
+/*
+ * The functions above work on a 27 bits mask of the voxel neighbors, and
+ * are too slow to be called for each voxel, so the mesher only uses them
+ * to fill some lookup tables:
  *
- *    x   :  4 bits
- *    y   :  4 bits
- *    z   :  4 bits
- *    pad :  1 bit
- *    face:  3 bits
- *    id  : 16 bits
- *    -------------
- *    tot : 32 bits
+ * - The ambient occlusion mask of a face only depends on the 9 voxels of
+ *   the plane in front of it.  We index the shadow uv word of the face
+ *   with those 9 bits, the bit
+ *   3 * j + k being the voxel at offset j - 1 along the first other axis
+ *   and k - 1 along the second one (for example x and z for the y faces).
+ * - The border mask of a face only depends on which of the 6 faces of the
+ *   voxel are visible.  We also store it as a bump uv word.
+ * - The four vertices of each face, with the values that don't depend on
+ *   the voxel already set.  We store them as three 64 bits words, each
+ *   with two 4 bytes fields of voxel_vertex_t, so that we can add the
+ *   voxel and face values to all the bytes of two fields at once (none of
+ *   them can overflow).
+ * - If all the solid voxels are opaque, the smooth normal components only
+ *   depend on the difference of the number of solid voxels at each side of
+ *   the voxel (-9 to 9) and the max of those differences.
+ * - spread[i] has the bit k of i moved to the bit 3 * k, so that we can
+ *   interleave three rows of voxels.
+ * - solid_bits puts back in order the solid bits of eight voxels, see
+ *   block_generate_vertices.
  */
-static uint32_t get_pos_data(uint32_t x, uint32_t y, uint32_t z, uint32_t f,
-                             uint32_t i)
+static struct {
+    uint32_t        shadow_uvs[6][512];
+    uint32_t        border_uvs[6][64];
+    uint8_t         bits_count[512];
+    uint64_t        vertices[6][4][3];
+    int8_t          normals[10][19];
+    uint32_t        spread[256];
+    uint8_t         solid_bits[256];
+    int             lock;
+    bool            initialized;
+} g_tables = {};
+
+static void init_tables(void)
+{
+    int f, i, j, k, idx, kmax, axis, u, v;
+    int p[3];
+    uint32_t mask;
+    int shadow_mask;
+    vec3b_t n;
+    voxel_vertex_t vertex;
+    const int ts = VOXEL_TEXTURE_SIZE;
+
+    _Static_assert(sizeof(voxel_vertex_t) == 3 * 8, "");
+    if (g_tables.initialized) return;
+    while (__sync_lock_test_and_set(&g_tables.lock, 1)) {}
+    if (g_tables.initialized) goto end;
+
+    for (f = 0; f < 6; f++) {
+        n = FACES_NORMALS[f];
+        axis = n.x ? 0 : n.y ? 1 : 2;
+        u = axis == 0 ? 1 : 0;
+        v = axis == 2 ? 1 : 2;
+        for (idx = 0; idx < 512; idx++) {
+            mask = 0;
+            for (i = 0; i < 9; i++) {
+                if (!(idx & (1 << i))) continue;
+                p[axis] = n.v[axis];
+                p[u] = i / 3 - 1;
+                p[v] = i % 3 - 1;
+                mask |= 1 << ((p[0] + 1) + (p[1] + 1) * 3 + (p[2] + 1) * 9);
+            }
+            shadow_mask = block_get_shadow_mask(mask, f);
+            g_tables.shadow_uvs[f][idx] = pack_bytes(
+                    shadow_mask % 16 * ts, shadow_mask / 16 * ts, 0, 0);
+        }
+        for (idx = 0; idx < 64; idx++) {
+            mask = 0;
+            for (k = 0; k < 6; k++) {
+                if (idx & (1 << k)) continue;
+                n = FACES_NORMALS[k];
+                mask |= 1 << ((n.x + 1) + (n.y + 1) * 3 + (n.z + 1) * 9);
+            }
+            g_tables.border_uvs[f][idx] = pack_bytes(
+                    block_get_border_mask(mask, f, EFFECT_BORDERS) * 16,
+                    0, 0, 0);
+        }
+        for (i = 0; i < 4; i++) {
+            vertex = (voxel_vertex_t) {
+                .pos = VERTICES_POSITIONS[FACES_VERTICES[f][i]],
+                .uv = uvec2b(VERTICE_UV[i].x * 255, VERTICE_UV[i].y * 255),
+                .bshadow_uv = uvec2b(VERTICE_UV[i].x * (ts - 1),
+                                     VERTICE_UV[i].y * (ts - 1)),
+                .bump_uv = uvec2b(0, f * 16),
+            };
+            memcpy(g_tables.vertices[f][i], &vertex, sizeof(vertex));
+        }
+    }
+    for (idx = 0; idx < 512; idx++)
+        g_tables.bits_count[idx] = __builtin_popcount(idx);
+    for (idx = 0; idx < 256; idx++) {
+        for (j = 0; j < 8; j++) {
+            if (!(idx & (1 << j))) continue;
+            g_tables.spread[idx] |= 1 << (3 * j);
+            // The alpha of the voxel i ends up in the byte
+            // 3 + 4 * (i % 2) - i / 2, and the bit of the byte k in the
+            // bit 7 - k.
+            for (i = 0; i < 8; i++) {
+                if (7 - (3 + 4 * (i % 2) - i / 2) == j)
+                    g_tables.solid_bits[idx] |= 1 << i;
+            }
+        }
+    }
+    // Normal from block_get_normal_sum with all the neighbors alpha at 255.
+    for (kmax = 1; kmax < 10; kmax++)
+    for (k = -9; k <= 9; k++)
+        g_tables.normals[kmax][k + 9] = -255 * k * 127 / (255 * kmax);
+    __sync_synchronize();
+    g_tables.initialized = true;
+end:
+    __sync_lock_release(&g_tables.lock);
+}
+
+// Pack two 4 bytes fields in a 64 bits word, with their memory layout.
+static inline uint64_t pack_words(uint32_t a, uint32_t b)
 {
-    assert(BLOCK_SIZE == 16);
-    return (x << 28) | (y << 24) | (z << 20) | (f << 16) | (i & 0xffff);
+    const uint32_t v[2] = {a, b};
+    uint64_t ret;
+    memcpy(&ret, v, sizeof(ret));
+    return ret;
 }
 
+// Set the 64 bits word i of a vertex.
+static inline void put_word(uint8_t *vertex, int i, uint64_t v)
+{
+    memcpy(vertex + i * 8, &v, sizeof(v));
+}
+
+static inline uint64_t spread_row(uint32_t row)
+{
+    return g_tables.spread[row & 255] |
+           (uint64_t)g_tables.spread[row >> 8] << 24;
+}
+
+/*
+ * Generate the quads of all the visible faces of the block.
+ *
+ * We first put the solid voxels in a bitmask of one uint16_t per row along
+ * x, testing eight voxels at once, so that we get the visible faces of a
+ * whole row with a few shifts.  For each row with visible faces we then
+ * interleave the rows around it, so that the 9 bits plane in front of any
+ * face of the row is a single shift away, and can be used as index in the
+ * tables.
+ */
 int block_generate_vertices(const block_data_t *data, int effects,
-                            int block_id, voxel_vertex_t *out)
+                            voxel_vertex_t *out)
 {
-    int x, y, z, f;
-    int i, nb = 0;
-    uint32_t neighboors_mask;
-    uint8_t shadow_mask, borders_mask;
-    vec3b_t normal;
-    const int ts = VOXEL_TEXTURE_SIZE;
-    uint8_t neighboors[27];
-    if (effects & EFFECT_MARCHING_CUBES)
-        return block_generate_vertices_mc(data, effects, out);
+    // Alpha bytes of two voxels in a 64 bits word (little endian).
+    const uint64_t ALPHAS = 0xFF000000FF000000ULL;
+    const uint64_t ONES = 0x0101010101010101ULL;
+    const uint64_t LOWS = 0x7F7F7F7F7F7F7F7FULL;
+    const uint64_t HIGHS = 0x8080808080808080ULL;
+    // Moves the bit 0 of each byte k to the bit 63 - k.
+    const uint64_t GATHER = 0x8040201008040201ULL;
+    int x, y, z, f, i, nb = 0, visible, faces_left, s[3], smax, k[3];
+    int dy, dz;
+    uint32_t row, faces[6], any, planes[6];
+    uint64_t w[4], a, solid, translucent = 0, spreads[3][3], wy[3], wz[2];
+    // Solid voxels bitmask, indexed by [z][y].
+    uint16_t rows[BLOCK_SIZE][BLOCK_SIZE];
+    bool smooth = effects & EFFECT_SMOOTH;
+    vec3b_t normal, smooth_normal = {};
+    uvec4b_t color;
+    uint32_t pos, normal_word = 0, bump_uv;
+    uint64_t pos_normal, color_word, uvs;
+    const uint64_t *t;
+    uint8_t *o;
+
+    init_tables();
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        row = 0;
+        for (x = 0; x < N; x += 8) {
+            // Put the alpha of eight voxels in a word, and test them all at
+            // once: a voxel is solid if alpha >= 127, that is if the bit 7
+            // of alpha or of (alpha & 127) + 1 is set.
+            memcpy(w, &DATA_AT(data, x, y, z), sizeof(w));
+            a = (w[0] & ALPHAS) | (w[1] & ALPHAS) >> 8 |
+                (w[2] & ALPHAS) >> 16 | (w[3] & ALPHAS) >> 24;
+            solid = (a | ((a & LOWS) + ONES)) & HIGHS;
+            // Solid with an alpha that is not 255, only used for the smooth
+            // normals.
+            if (smooth) translucent |= solid & (~a | ((~a & LOWS) + LOWS));
+            row |= g_tables.solid_bits[(solid >> 7) * GATHER >> 56] << x;
+        }
+        rows[z][y] = row;
+    }
+    translucent &= HIGHS;
+
+    for (z = 1; z < N - 1; z++)
+    for (y = 1; y < N - 1; y++) {
+        row = rows[z][y] & ((1 << (N - 1)) - 2);
+        if (!row) continue;
+        // Visible faces of the row, in the faces order.
+        faces[0] = row & ~rows[z][y - 1];
+        faces[1] = row & ~rows[z][y + 1];
+        faces[2] = row & ~rows[z - 1][y];
+        faces[3] = row & ~rows[z + 1][y];
+        faces[4] = row & ~(rows[z][y] >> 1);
+        faces[5] = row & ~(rows[z][y] << 1);
+        any = faces[0] | faces[1] | faces[2] | faces[3] | faces[4] | faces[5];
+        if (!any) continue;
+
+        // wy[dy] has the voxels of the rows (dz, dy) at the bits
+        // 3 * x + dz, and wz[dz] those of the rows (dz, dy) at the bits
+        // 3 * x + dy (with dy and dz from 0 to 2 here).
+        for (dz = 0; dz < 3; dz++)
+        for (dy = 0; dy < 3; dy++)
+            spreads[dz][dy] = spread_row(rows[z + dz - 1][y + dy - 1]);
+        for (dy = 0; dy < 3; dy++)
+            wy[dy] = spreads[0][dy] | spreads[1][dy] << 1 |
+                     spreads[2][dy] << 2;
+        wz[0] = spreads[0][0] | spreads[0][1] << 1 | spreads[0][2] << 2;
+        wz[1] = spreads[2][0] | spreads[2][1] << 1 | spreads[2][2] << 2;
+
+        while (any) {
+            x = __builtin_ctz(any);
+            any &= any - 1;
+            visible = 0;
+            for (f = 0; f < 6; f++)
+                visible |= ((faces[f] >> x) & 1) << f;
+
+            planes[0] = (wy[0] >> (3 * x - 3)) & 511;
+            planes[1] = (wy[2] >> (3 * x - 3)) & 511;
+            planes[2] = (wz[0] >> (3 * x - 3)) & 511;
+            planes[3] = (wz[1] >> (3 * x - 3)) & 511;
+            planes[4] = ((wy[0] >> (3 * x + 3)) & 7) |
+                        ((wy[1] >> (3 * x + 3)) & 7) << 3 |
+                        ((wy[2] >> (3 * x + 3)) & 7) << 6;
+            planes[5] = ((wy[0] >> (3 * x - 3)) & 7) |
+                        ((wy[1] >> (3 * x - 3)) & 7) << 3 |
+                        ((wy[2] >> (3 * x - 3)) & 7) << 6;
+
+            smax = 0;
+            if (smooth) {
+                if (!translucent) {
+                    k[0] = g_tables.bits_count[planes[4]] -
+                           g_tables.bits_count[planes[5]];
+                    k[1] = g_tables.bits_count[planes[1]] -
+                           g_tables.bits_count[planes[0]];
+                    k[2] = g_tables.bits_count[planes[3]] -
+                           g_tables.bits_count[planes[2]];
+                    smax = max(abs(k[0]), max(abs(k[1]), abs(k[2])));
+                    if (smax) smooth_normal = vec3b(
+                            g_tables.normals[smax][k[0] + 9],
+                            g_tables.normals[smax][k[1] + 9],
+                            g_tables.normals[smax][k[2] + 9]);
+                } else {
+                    block_get_normal_sum(data, x, y, z, s);
+                    smax = max(abs(s[0]), max(abs(s[1]), abs(s[2])));
+                    if (smax) smooth_normal = vec3b(-s[0] * 127 / smax,
+                                                    -s[1] * 127 / smax,
+                                                    -s[2] * 127 / smax);
+                }
+            }
+            color = DATA_AT(data, x, y, z);
+            color_word = pack_words(
+                    pack_bytes(color.r, color.g, color.b, 255), 0);
+            pos = pack_bytes(x, y, z, 0);
+            if (smax)
+                normal_word = pack_bytes(smooth_normal.x, smooth_normal.y,
+                                         smooth_normal.z, 0);
+
+            faces_left = visible;
+            while (faces_left) {
+                f = __builtin_ctz(faces_left);
+                faces_left &= faces_left - 1;
+                if (!smax) {
+                    normal = FACES_NORMALS[f];
+                    normal_word = pack_bytes(normal.x, normal.y, normal.z,
+                                             0);
+                }
+                pos_normal = pack_words(pos, normal_word);
+                if (effects & EFFECT_BORDERS_ALL)
+                    bump_uv = pack_bytes(15 * 16, 0, 0, 0);
+                else if (effects & EFFECT_BORDERS)
+                    bump_uv = g_tables.border_uvs[f][visible];
+                else
+                    bump_uv = 0;
+                uvs = pack_words(g_tables.shadow_uvs[f][planes[f]], bump_uv);
+                for (i = 0; i < 4; i++) {
+                    t = g_tables.vertices[f][i];
+                    o = (uint8_t*)&out[nb * 4 + i];
+                    put_word(o, 0, t[0] + pos_normal);
+                    put_word(o, 1, t[1] + color_word);
+                    put_word(o, 2, t[2] + uvs);
+                }
+                nb++;
+            }
+        }
+    }
+    return nb;
+}
+
+/*
+ * LOD meshes.
+ *
+ * The pyramid of a block data has the levels 8^3, 4^3 and 2^3: each cell
+ * of level l covers 2^l voxels along each axis of the block, clipped to the
+ * block interior, so the first and last cells are a bit smaller.  The alpha
+ * of a cell is the max of its voxels alpha, and the color the mean of its
+ * solid voxels, so that a cell is solid as soon as one of its voxels is.
+ *
+ * Since the coarse cells always contain the real voxels, and we test the
+ * faces on the sides of the block against the real border voxels, there
+ * can't be any crack between two blocks rendered at different levels: if
+ * we skip a face, all the voxels in front of it are solid.
+ */
+
+typedef struct {
+    uvec4b_t cells[512 + 64 + 8];
+} block_lod_t;
+
+#define LOD_OFFSET(l) ((l) == 1 ? 0 : (l) == 2 ? 512 : 512 + 64)
+#define CELL_AT(cells, n, x, y, z) ((cells)[(x) + (y) * (n) + (z) * (n) * (n)])
+
+// Not thread safe, the LOD meshes are only generated by the renderer.
+static cache_t *g_lod_cache = NULL;
+
+static int lod_del(void *lod)
+{
+    free(lod);
+    return 0;
+}
+
+static const uvec4b_t *get_lod_cells(const block_data_t *data, int level)
+{
+    block_lod_t *lod;
+    int x, y, z, l, n, i, k;
+    uvec4b_t v;
+    uint32_t sums[ARRAY_SIZE(lod->cells)][4] = {}; // r, g, b, count.
+
+    if (!g_lod_cache) g_lod_cache = cache_create(16 * 1024 * 1024);
+    lod = cache_get(g_lod_cache, &data->id, sizeof(data->id));
+    if (lod) return lod->cells + LOD_OFFSET(level);
+
+    lod = calloc(1, sizeof(*lod));
     BLOCK_ITER_INSIDE(x, y, z) {
-        if (DATA_AT(data, x, y, z).a < 127) continue;    // Non visible
-        neighboors_mask = block_get_neighboors(data, x, y, z, neighboors);
+        v = DATA_AT(data, x, y, z);
+        if (!v.a) continue;
+        for (l = 1; l <= BLOCK_LOD_MAX; l++) {
+            n = N >> l;
+            i = LOD_OFFSET(l) + (x >> l) + (y >> l) * n + (z >> l) * n * n;
+            lod->cells[i].a = max(lod->cells[i].a, v.a);
+            if (v.a < 127) continue;
+            sums[i][0] += v.r;
+            sums[i][1] += v.g;
+            sums[i][2] += v.b;
+            sums[i][3]++;
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(lod->cells); i++) {
+        if (!sums[i][3]) continue;
+        for (k = 0; k < 3; k++)
+            lod->cells[i].v[k] = sums[i][k] / sums[i][3];
+    }
+    cache_add(g_lod_cache, &data->id, sizeof(data->id), lod, sizeof(*lod),
+              lod_del);
+    return lod->cells + LOD_OFFSET(level);
+}
+
+// Check if the face f of a cell, covering the voxels lo to hi, is visible.
+static bool lod_face_visible(const block_data_t *data, const uvec4b_t *cells,
+                             int n, const int c[3], const int lo[3],
+                             const int hi[3], int f)
+{
+    const vec3b_t d = FACES_NORMALS[f];
+    int i, x, y, z, p[3], r[2][3];
+
+    for (i = 0; i < 3; i++) p[i] = c[i] + d.v[i];
+    if (p[0] >= 0 && p[0] < n && p[1] >= 0 && p[1] < n &&
+        p[2] >= 0 && p[2] < n)
+        return CELL_AT(cells, n, p[0], p[1], p[2]).a < 127;
+
+    // Side of the block: visible if any border voxel in front is not solid.
+    for (i = 0; i < 3; i++) {
+        r[0][i] = d.v[i] > 0 ? hi[i] : d.v[i] < 0 ? lo[i] - 1 : lo[i];
+        r[1][i] = d.v[i] ? r[0][i] + 1 : hi[i];
+    }
+    for (z = r[0][2]; z < r[1][2]; z++)
+    for (y = r[0][1]; y < r[1][1]; y++)
+    for (x = r[0][0]; x < r[1][0]; x++) {
+        if (DATA_AT(data, x, y, z).a < 127) return true;
+    }
+    return false;
+}
+
+int block_generate_vertices_lod(const block_data_t *data, int level,
+                                voxel_vertex_t *out)
+{
+    const uvec4b_t *cells;
+    const int n = N >> level, s = 1 << level;
+    int c[3], lo[3], hi[3], f, i, nb = 0;
+    uvec4b_t color;
+    voxel_vertex_t t;
+
+    assert(level >= 1 && level <= BLOCK_LOD_MAX);
+    init_tables();
+    cells = get_lod_cells(data, level);
+    for (c[2] = 0; c[2] < n; c[2]++)
+    for (c[1] = 0; c[1] < n; c[1]++)
+    for (c[0] = 0; c[0] < n; c[0]++) {
+        color = CELL_AT(cells, n, c[0], c[1], c[2]);
+        if (color.a < 127) continue;
+        color.a = 255;
+        for (i = 0; i < 3; i++) {
+            lo[i] = max(c[i] * s, 1);
+            hi[i] = min(c[i] * s + s, N - 1);
+        }
         for (f = 0; f < 6; f++) {
-            if (!block_is_face_visible(neighboors_mask, f)) continue;
-            normal = block_get_normal(neighboors_mask, neighboors, f,
-                     effects & EFFECT_SMOOTH);
-            shadow_mask = block_get_shadow_mask(neighboors_mask, f);
-            borders_mask = block_get_border_mask(neighboors_mask, f, effects);
+            if (!lod_face_visible(data, cells, n, c, lo, hi, f)) continue;
+            // Far away blocks: flat normals, and no borders or shadows.
             for (i = 0; i < 4; i++) {
-                out[nb * 4 + i].pos = vec3b_add(
-                        vec3b(x, y, z),
-                        VERTICES_POSITIONS[FACES_VERTICES[f][i]]);
-                out[nb * 4 + i].normal = normal;
-                out[nb * 4 + i].color = DATA_AT(data, x, y, z);
-                out[nb * 4 + i].color.a = out[nb * 4 + i].color.a ? 255 : 0;
-                out[nb * 4 + i].bshadow_uv = uvec2b(
-                    shadow_mask % 16 * ts + VERTICE_UV[i].x * (ts - 1),
-                    shadow_mask / 16 * ts + VERTICE_UV[i].y * (ts - 1));
-                out[nb * 4 + i].uv = uvec2b(VERTICE_UV[i].x * 255,
-                                            VERTICE_UV[i].y * 255);
-                // For testing:
-                // This put a border bump on all the edges of the voxel.
-                out[nb * 4 + i].bump_uv = uvec2b(borders_mask * 16, f * 16);
-                out[nb * 4 + i].pos_data = get_pos_data(x, y, z, f, block_id);
+                memcpy(&t, g_tables.vertices[f][i], sizeof(t));
+                out[nb * 4 + i] = (voxel_vertex_t) {
+                    .pos = vec3b(t.pos.x ? hi[0] : lo[0],
+                                 t.pos.y ? hi[1] : lo[1],
+                                 t.pos.z ? hi[2] : lo[2]),
+                    .normal = FACES_NORMALS[f],
+                    .color = color,
+                    .uv = t.uv,
+                    .bshadow_uv = t.bshadow_uv,
+                    .bump_uv = t.bump_uv,
+                };
             }
             nb++;
         }
@@ -358,6 +704,38 @@ int block_generate_vertices(const block_data_t *data, int effects,
     return nb;
 }
 
+static bool border_is_solid(const block_data_t *data, int f)
+{
+    const vec3b_t n = FACES_NORMALS[f];
+    const int a = n.x ? 0 : n.y ? 1 : 2;
+    int i, j, p[3];
+
+    p[a] = n.v[a] > 0 ? N - 1 : 0;
+    for (i = 1; i < N - 1; i++)
+    for (j = 1; j < N - 1; j++) {
+        p[(a + 1) % 3] = i;
+        p[(a + 2) % 3] = j;
+        if (DATA_AT(data, p[0], p[1], p[2]).a < 127) return false;
+    }
+    return true;
+}
+
+int block_get_solid_borders(const block_t *block)
+{
+    block_data_t *data = block->data;
+    int f, mask = 0;
+    if (data->solid_borders) return data->solid_borders & 63;
+    for (f = 0; f < 6; f++)
+        if (border_is_solid(data, f)) mask |= 1 << f;
+    data->solid_borders = mask | 64;
+    return mask;
+}
+
+bool block_is_hidden(const block_t *block)
+{
+    return block_get_solid_borders(block) == 63;
+}
+
 static vec3_t block_get_voxel_pos(const block_t *block, int x, int y, int z)
 {
     return vec3(block->pos.x + x - BLOCK_SIZE / 2 + 0.5,
@@ -368,17 +746,20 @@ static vec3_t block_get_voxel_pos(const block_t *block, int x, int y, int z)
 // Copy the data if there are any other blocks having reference to it.
 static void block_prepare_write(block_t *block)
 {
-    if (block->data->ref == 1) {
+    block_data_t *data;
+    if (__atomic_load_n(&block->data->ref, __ATOMIC_ACQUIRE) == 1) {
+        block->data->solid_borders = 0;
         return;
     }
-    block->data->ref--;
-    block_data_t *data;
     data = calloc(1, sizeof(*block->data));
     memcpy(data->voxels, block->data->voxels, N * N * N * 4);
     data->ref = 1;
+    data->id = __sync_add_and_fetch(&goxel->next_uid, 1);
+    __sync_add_and_fetch(&goxel->block_count, 1);
+    // Only release the old data once copied: if the count gets down to one
+    // the other owner can modify it in place.
+    data_release(block->data);
     block->data = data;
-    block->data->id = ++goxel->next_uid;
-    goxel->block_count++;
 }
 
 void block_fill(block_t *block,
@@ -436,10 +817,11 @@ static uvec4b_t combine(uvec4b_t a, uvec4b_t b, int mode)
 // XXX: cleanup this function.
 void block_op(block_t *block, painter_t *painter, const box_t *box)
 {
-    int x, y, z;
+    int x, y, z, i, lo[3] = {0, 0, 0}, hi[3] = {N, N, N};
     mat4_t mat = mat4_identity;
     vec3_t p, size;
-    float k, v;
+    box_t clip;
+    float k, v, d[3][N];
     int mode = painter->mode;
     uvec4b_t c;
     float (*shape_func)(const vec3_t*, const vec3_t*, float smoothness);
@@ -453,23 +835,45 @@ void block_op(block_t *block, painter_t *painter, const box_t *box)
 
     size = box_get_size(*box);
     mat4_imul(&mat, box->mat);
+    mat.v[12] = mat.v[13] = mat.v[14] = 0;
     mat4_iscale(&mat, 1 / size.x, 1 / size.y, 1 / size.z);
     mat4_invert(&mat);
 
-    mat4_itranslate(&mat, block->pos.x, block->pos.y, block->pos.z);
-    mat4_itranslate(&mat, -N / 2 + 0.5, -N / 2 + 0.5, -N / 2 + 0.5);
+    // Position of the voxels centers relative to the box center, computed
+    // exactly in double before the rounding, so that a voxel value only
+    // depends on its position relative to the box, whatever the block: the
+    // same op moved by an integer offset gives exactly the same voxels.
+    // The procedural instances rely on it, see mesh_stamp.
+    for (i = 0; i < 3; i++)
+    for (x = 0; x < N; x++)
+        d[i][x] = block->pos.v[i] + x - N / 2 + 0.5 - (double)box->p.v[i];
 
-    BLOCK_ITER(x, y, z) {
+    // Only touch the voxels whose center is inside the clipping box.
+    if (painter->box) {
+        clip = box_get_bbox(*painter->box);
+        for (i = 0; i < 3; i++) {
+            v = block->pos.v[i] - N / 2 + 0.5; // Center of the voxel 0.
+            lo[i] = max(floor(clip.p.v[i] - clip.mat.v[i * 5] - v) + 1, 0);
+            hi[i] = min(ceil(clip.p.v[i] + clip.mat.v[i * 5] - v), N);
+        }
+    }
+
+    for (z = lo[2]; z < hi[2]; z++)
+    for (y = lo[1]; y < hi[1]; y++)
+    for (x = lo[0]; x < hi[0]; x++) {
         c = painter->color;
         if (can_skip(BLOCK_AT(block, x, y, z), mode, c)) continue;
-        p = mat4_mul_vec3(mat, vec3(x, y, z));
+        p = mat4_mul_vec3(mat, vec3(d[0][x], d[1][y], d[2][z]));
         k = shape_func(&p, &size, painter->smoothness);
         k = clamp(k / painter->smoothness, -1, 1);
         v = (k + 1) * 0.5;
         if (invert) v = 1.0 - v;
         if (v) {
-            block_prepare_write(block);
             c.a *= v;
+            // Blending a transparent color doesn't change anything, and we
+            // don't want to keep blocks without any visible voxel.
+            if (mode == MODE_OVER && !c.a) continue;
+            block_prepare_write(block);
             BLOCK_AT(block, x, y, z) = combine(
                 BLOCK_AT(block, x, y, z), c, mode);
         }
@@ -479,12 +883,7 @@ void block_op(block_t *block, painter_t *painter, const box_t *box)
 // Used for the cache.
 static int block_del(void *data_)
 {
-    block_data_t *data = data_;
-    data->ref--;
-    if (data->ref == 0) {
-        free(data);
-        goxel->block_count--;
-    }
+    data_release(data_);
     return 0;
 }
 
@@ -521,10 +920,53 @@ void block_merge(block_t *block, const block_t *other, int mode)
                                            DATA_AT(other->data, x, y, z),
                                            mode);
     }
-    block->data->ref++;
+    __sync_add_and_fetch(&block->data->ref, 1);
     cache_add(cache, &key, sizeof(key), block->data, 1, block_del);
 }
 
+void block_stamp(block_t *block, const block_data_t *data, const vec3i_t *pos)
+{
+    int x, y, z, i, d[3], lo[3], hi[3];
+    uvec4b_t v, c;
+
+    // Only use the interior voxels of the data, so that each voxel is
+    // merged once even if we stamp several neighbour blocks.
+    for (i = 0; i < 3; i++) {
+        d[i] = block->pos.v[i] - pos->v[i];
+        lo[i] = max(0, 1 - d[i]);
+        hi[i] = min(N, N - 1 - d[i]);
+    }
+    for (z = lo[2]; z < hi[2]; z++)
+    for (y = lo[1]; y < hi[1]; y++)
+    for (x = lo[0]; x < hi[0]; x++) {
+        v = DATA_AT(data, x + d[0], y + d[1], z + d[2]);
+        c = BLOCK_AT(block, x, y, z);
+        if (!v.a || can_skip(c, MODE_OVER, v)) continue;
+        block_prepare_write(block);
+        BLOCK_AT(block, x, y, z) = combine(c, v, MODE_OVER);
+    }
+}
+
+bool block_can_stamp(const block_t *block, const block_data_t *data,
+                     const vec3i_t *pos)
+{
+    int x, y, z, i, d[3], lo[3], hi[3];
+    uvec4b_t v;
+
+    for (i = 0; i < 3; i++) {
+        d[i] = block->pos.v[i] - pos->v[i];
+        lo[i] = max(0, 1 - d[i]);
+        hi[i] = min(N, N - 1 - d[i]);
+    }
+    for (z = lo[2]; z < hi[2]; z++)
+    for (y = lo[1]; y < hi[1]; y++)
+    for (x = lo[0]; x < hi[0]; x++) {
+        v = DATA_AT(data, x + d[0], y + d[1], z + d[2]);
+        if (v.a && v.a < 255 && BLOCK_AT(block, x, y, z).a) return false;
+    }
+    return true;
+}
+
 uvec4b_t block_get_at(const block_t *block, const vec3_t *pos)
 {
     int x, y, z;
@@ -176,6 +176,31 @@ static inline box_t bbox_merge(box_t a, box_t b)
                             (r1.z - r0.z) / 2);
 }
 
+// Intersection of two bounding boxes, that must intersect.
+static inline box_t bbox_intersection(box_t a, box_t b)
+{
+    assert(box_is_bbox(a));
+    assert(box_is_bbox(b));
+
+    vec3_t a0, a1, b0, b1, r0, r1;
+    a0 = vec3(a.p.x - a.w.x, a.p.y - a.h.y, a.p.z - a.d.z);
+    a1 = vec3(a.p.x + a.w.x, a.p.y + a.h.y, a.p.z + a.d.z);
+    b0 = vec3(b.p.x - b.w.x, b.p.y - b.h.y, b.p.z - b.d.z);
+    b1 = vec3(b.p.x + b.w.x, b.p.y + b.h.y, b.p.z + b.d.z);
+
+    r0.x = max(a0.x, b0.x);
+    r0.y = max(a0.y, b0.y);
+    r0.z = max(a0.z, b0.z);
+    r1.x = min(a1.x, b1.x);
+    r1.y = min(a1.y, b1.y);
+    r1.z = min(a1.z, b1.z);
+
+    return bbox_from_extents(vec3_mix(r0, r1, 0.5),
+                            (r1.x - r0.x) / 2,
+                            (r1.y - r0.y) / 2,
+                            (r1.z - r0.z) / 2);
+}
+
 static inline bool bbox_contains_vec(box_t b, vec3_t v)
 {
     assert(box_is_bbox(b));
@@ -31,26 +31,32 @@ struct item {
 struct cache {
     item_t *items;
     uint64_t clock;
-    int size;
-    int max_size;
+    int64_t size;
+    int64_t max_size;
 };
 
-cache_t *cache_create(int size)
+cache_t *cache_create(int64_t size)
 {
     cache_t *cache = calloc(1, sizeof(*cache));
     cache->max_size = size;
     return cache;
 }
 
-static void cleanup(cache_t *cache)
+static void del_item(cache_t *cache, item_t *item)
 {
-    item_t *item;
-    while (cache->size >= cache->max_size) {
-        item = cache->items;
-        HASH_DEL(cache->items, item);
-        item->delfunc(item->data);
-        cache->size -= item->cost;
-        free(item);
+    HASH_DEL(cache->items, item);
+    item->delfunc(item->data);
+    cache->size -= item->cost;
+    free(item);
+}
+
+// Remove the least recently used items until we fit in the max size.
+// We never remove 'keep', since the caller is still going to use it.
+static void cleanup(cache_t *cache, const item_t *keep)
+{
+    while (cache->size >= cache->max_size && cache->items &&
+           cache->items != keep) {
+        del_item(cache, cache->items);
     }
 }
 
@@ -66,7 +72,7 @@ void cache_add(cache_t *cache, const void *key, int len, void *data,
     item->delfunc = delfunc;
     HASH_ADD(hh, cache->items, key, len, item);
     cache->size += cost;
-    if (cache->size >= cache->max_size) cleanup(cache);
+    if (cache->size >= cache->max_size) cleanup(cache, item);
 }
 
 void *cache_get(cache_t *cache, const void *key, int keylen)
@@ -80,3 +86,27 @@ void *cache_get(cache_t *cache, const void *key, int keylen)
     HASH_ADD(hh, cache->items, key, keylen, item);
     return item->data;
 }
+
+void cache_set_max_size(cache_t *cache, int64_t size)
+{
+    cache->max_size = size;
+    cleanup(cache, NULL);
+}
+
+int64_t cache_get_size(const cache_t *cache)
+{
+    return cache->size;
+}
+
+int cache_evict(cache_t *cache, bool (*expired)(void *data, void *user),
+                void *user)
+{
+    int ret = 0;
+    // The items are sorted from the least recently used, so we can stop
+    // as soon as we find one that is still valid.
+    while (cache->items && expired(cache->items->data, user)) {
+        del_item(cache, cache->items);
+        ret++;
+    }
+    return ret;
+}
@@ -211,6 +211,7 @@ static void chunk_write_all(gzFile out, const char *type,
 
 void save_to_file(goxel_t *goxel, const char *path)
 {
+    PROFILED;
     // XXX: remove all empty blocks before saving.
     LOG_I("Save to %s", path);
     block_hash_t *blocks_table = NULL, *data, *data_tmp;
@@ -315,6 +316,7 @@ static block_hash_t *hash_find_at(block_hash_t *hash, int index)
 
 void load_from_file(goxel_t *goxel, const char *path)
 {
+    PROFILED;
     layer_t *layer, *layer_tmp;
     block_hash_t *blocks_table = NULL, *data, *data_tmp;
     gzFile in;
@@ -358,7 +360,7 @@ void load_from_file(goxel_t *goxel, const char *path)
             data = calloc(1, sizeof(*data));
             data->v = calloc(1, sizeof(*data->v));
             memcpy(data->v->voxels, voxel_data, sizeof(data->v->voxels));
-            data->v->id = ++goxel->next_uid;
+            data->v->id = __sync_add_and_fetch(&goxel->next_uid, 1);
             HASH_ADD_PTR(blocks_table, v, data);
             free(voxel_data);
             free(png);
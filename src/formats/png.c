@@ -18,42 +18,129 @@
 
 #include "goxel.h"
 
-// XXX: this function has to be rewritten.
+/*
+ * The png export renders the image at twice the resolution, and
+ * downsamples it.  To support images bigger than the max framebuffer size,
+ * and not need the whole image in memory, we render it by horizontal bands
+ * of tiles, each tile with its own sub frustum of the camera projection.
+ * Once a band is done we downsample it and send the rows to the png writer.
+ */
+
+// Max tile size in the supersampled image.  Must be a power of two.
+#define EXPORT_TILE_SIZE 4096
+// Max number of supersampled pixels in a band.
+#define EXPORT_BAND_PIXELS (16 * 1024 * 1024)
+
+typedef struct {
+    const uint8_t *src; // Supersampled band.
+    uint8_t *dst;
+    int w;              // Width of the final image.
+} downsample_job_t;
+
+static void downsample_row(int i, void *user)
+{
+    const downsample_job_t *job = user;
+    const uint8_t *s0 = job->src + (size_t)i * 2 * job->w * 2 * 4;
+    const uint8_t *s1 = s0 + (size_t)job->w * 2 * 4;
+    uint8_t *d = job->dst + (size_t)i * job->w * 4;
+    int x, k;
+    for (x = 0; x < job->w; x++)
+    for (k = 0; k < 4; k++) {
+        d[x * 4 + k] = (s0[x * 8 + k] + s0[x * 8 + 4 + k] +
+                        s1[x * 8 + k] + s1[x * 8 + 4 + k]) / 4;
+    }
+}
+
+// Render a sub rectangle of the supersampled image, with the rows from
+// top to bottom.
+static void render_tile(const renderer_t *rend_, texture_t *fbo,
+                        int sw, int sh, int x, int y, int w, int h,
+                        uint8_t *out)
+{
+    renderer_t rend = *rend_;
+    int rect[4] = {0, 0, w, h};
+    mat4_t mat = mat4_identity;
+
+    // Map the tile part of the clipping space to the full clipping space.
+    mat4_iscale(&mat, (float)sw / w, (float)sh / h, 1);
+    mat4_itranslate(&mat, -(2.0 * x + w) / sw + 1,
+                          (2.0 * y + h) / sh - 1, 0);
+    rend.proj_mat = mat4_mul(mat, rend.proj_mat);
+
+    if (!fbo) {
+        render_soft(&rend, goxel->layers_mesh, w, h, out);
+        return;
+    }
+    rend.fbo = fbo->framebuffer;
+    render_mesh(&rend, goxel->layers_mesh, 0);
+    render_render(&rend, rect, &vec4_zero);
+    texture_get_data(fbo, w, h, 4, out);
+}
+
 static void export_as_png(const char *path, int w, int h)
 {
-    w = w ?: goxel->image->export_width;
-    h = h ?: goxel->image->export_height;
-    int rect[4] = {0, 0, w * 2, h * 2};
-    uint8_t *data2, *data;
-    texture_t *fbo;
+    PROFILED;
     renderer_t rend = goxel->rend;
-    mesh_t *mesh;
     camera_t camera = goxel->camera;
+    texture_t *fbo = NULL;
+    png_writer_t *png;
+    uint8_t *band, *tile, *rows;
+    int sw, sh, tile_size, band_h, x, y, tw, i;
+    downsample_job_t job;
 
+    w = w ?: goxel->image->export_width;
+    h = h ?: goxel->image->export_height;
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                    "png\0*.png\0", NULL, "untitled.png");
     if (!path) return;
 
+    LOG_I("Exporting to file %s (%dx%d)", path, w, h);
     camera.aspect = (float)w / h;
-    LOG_I("Exporting to file %s", path);
-
-    mesh = goxel->layers_mesh;
-    fbo = texture_new_buffer(w * 2, h * 2, TF_DEPTH);
-
     camera_update(&camera);
     rend.view_mat = camera.view_mat;
     rend.proj_mat = camera.proj_mat;
-    rend.fbo = fbo->framebuffer;
+    rend.items = NULL; // Don't steal the items queued for the view.
 
-    render_mesh(&rend, mesh, 0);
-    render_render(&rend, rect, &vec4_zero);
-    data2 = calloc(w * h * 4 , 4);
-    data = calloc(w * h, 4);
-    texture_get_data(fbo, w * 2, h * 2, 4, data2);
-    img_downsample(data2, w * 2, h * 2, 4, data);
-    img_write(data, w, h, 4, path);
-    free(data2);
-    free(data);
+    sw = w * 2;
+    sh = h * 2;
+    tile_size = EXPORT_TILE_SIZE;
+    if (!goxel->headless) {
+        GL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &i));
+        while (tile_size > i) tile_size /= 2;
+    }
+    while (tile_size > 64 && tile_size / 2 >= max(sw, sh)) tile_size /= 2;
+    band_h = clamp(EXPORT_BAND_PIXELS / sw, 2, tile_size) & ~1;
+    band_h = min(band_h, sh);
+
+    png = png_writer_create(path, w, h, 4);
+    if (!png) return;
+    if (!goxel->headless)
+        fbo = texture_new_buffer(tile_size, band_h, TF_DEPTH);
+    band = malloc((size_t)sw * band_h * 4);
+    tile = malloc((size_t)tile_size * band_h * 4);
+    rows = malloc((size_t)w * band_h / 2 * 4);
+
+    for (y = 0; y < sh; y += band_h) {
+        job = (downsample_job_t) {band, rows, w};
+        band_h = min(band_h, sh - y);
+        for (x = 0; x < sw; x += tile_size) {
+            tw = min(tile_size, sw - x);
+            render_tile(&rend, fbo, sw, sh, x, y, tw, band_h, tile);
+            for (i = 0; i < band_h; i++) {
+                memcpy(band + ((size_t)i * sw + x) * 4,
+                       tile + (size_t)i * tw * 4, (size_t)tw * 4);
+            }
+        }
+        parallel_for(band_h / 2, downsample_row, &job);
+        png_writer_write(png, rows, band_h / 2);
+    }
+
+    if (png_writer_finish(png) != 0)
+        LOG_E("Cannot save to %s", path);
+    texture_delete(fbo);
+    free(band);
+    free(tile);
+    free(rows);
 }
 
 ACTION_REGISTER(export_as_png,
@@ -65,3 +152,50 @@ ACTION_REGISTER(export_as_png,
         .ext = "*.png\0",
     },
 )
+
+// Path traced export.  We save the image each time the number of samples
+// doubles, so that we can already look at the file during long renders.
+static void export_as_png_pathtraced(const char *path, int w, int h,
+                                     int samples)
+{
+    renderer_t rend = goxel->rend;
+    camera_t camera = goxel->camera;
+    pathtracer_t *pt;
+    uint8_t *data;
+    int i;
+    int64_t t0 = get_clock();
+
+    w = w ?: goxel->image->export_width;
+    h = h ?: goxel->image->export_height;
+    samples = samples ?: 64;
+    path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
+                   "png\0*.png\0", NULL, "untitled.png");
+    if (!path) return;
+
+    LOG_I("Path tracing to file %s (%d samples)", path, samples);
+    camera.aspect = (float)w / h;
+    camera_update(&camera);
+    rend.view_mat = camera.view_mat;
+    rend.proj_mat = camera.proj_mat;
+    pt = pathtracer_create(&rend, goxel->layers_mesh, w, h);
+    data = calloc(w * h, 4);
+    for (i = 1; i <= samples; i++) {
+        pathtracer_iter(pt);
+        if (i != samples && (i & (i - 1))) continue;
+        pathtracer_get_image(pt, data);
+        img_write(data, w, h, 4, path);
+        LOG_I("%d/%d samples (%.1f s)", i, samples,
+              (get_clock() - t0) / 1e9);
+    }
+    free(data);
+    pathtracer_delete(pt);
+}
+
+ACTION_REGISTER(export_as_png_pathtraced,
+    .help = "Export the image as a path traced png file",
+    .cfunc = export_as_png_pathtraced,
+    .csig = "vpiii",
+    .file_format = {
+        .name = "png (path traced)",
+    },
+)
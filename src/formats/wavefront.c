@@ -69,53 +69,86 @@ static int lines_count(UT_array *lines, const char *type)
     return ret;
 }
 
-void wavefront_export(const mesh_t *mesh, const char *path)
+// Fill the lines array with the vertices, normals and faces of the mesh.
+// The faces are quads, or triangles (with vs[3] set to zero) if the effects
+// include one of the smooth meshes.
+static void get_lines(const mesh_t *mesh, int effects, UT_array *lines)
 {
-    // XXX: Merge faces that can be merged into bigger ones.
-    //      Allow to chose between quads or triangles.
-    //      Also export mlt file for the colors.
     block_t *block;
-    voxel_vertex_t* verts;
+    voxel_vertex_t *verts, *vert;
+    uint16_t *indices = NULL;
     vec3_t v;
     uvec3b_t c;
-    int nb_quads, i, j;
+    int nb_faces, nb_indices, size, i, j;
+    float scale = 1;
     mat4_t mat;
-    FILE *out;
     const int N = BLOCK_SIZE;
-    UT_array *lines;
-    line_t line, face, *line_ptr;
-
-    utarray_new(lines, &line_icd);
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    line_t line, face;
+
+    effects &= EFFECT_SMOOTH_MESH | EFFECT_FLAT;
+    if (effects & EFFECT_SMOOTH_MESH) {
+        verts = calloc(BLOCK_MC_MAX_VERTICES, sizeof(*verts));
+        indices = calloc(BLOCK_MC_MAX_INDICES, sizeof(*indices));
+        scale = 1.0 / MC_VOXEL_SUB_POS;
+        size = 3;
+    } else {
+        verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+        size = 4;
+    }
     face = (line_t){"f "};
     MESH_ITER_BLOCKS(mesh, block) {
         mat = mat4_identity;
         mat4_itranslate(&mat, block->pos.x, block->pos.y, block->pos.z);
         mat4_itranslate(&mat, -N / 2 + 0.5, -N / 2 + 0.5, -N / 2 + 0.5);
 
-        nb_quads = block_generate_vertices(block->data, 0, 0, verts);
-        for (i = 0; i < nb_quads; i++) {
-            // Put the vertices.
-            for (j = 0; j < 4; j++) {
-                v = vec3(verts[i * 4 + j].pos.x,
-                         verts[i * 4 + j].pos.y,
-                         verts[i * 4 + j].pos.z);
+        if (effects & EFFECT_SURFACE_NETS) {
+            block_generate_vertices_sn(block->data, effects, verts,
+                                       indices, &nb_indices);
+            nb_faces = nb_indices / 3;
+        } else if (effects & EFFECT_MARCHING_CUBES) {
+            block_generate_vertices_mc(block->data, effects, verts,
+                                       indices, &nb_indices);
+            nb_faces = nb_indices / 3;
+        } else {
+            nb_faces = block_generate_vertices(block->data, 0, verts);
+        }
+        for (i = 0; i < nb_faces; i++) {
+            for (j = 0; j < size; j++) {
+                vert = indices ? &verts[indices[i * 3 + j]]
+                               : &verts[i * 4 + j];
+                // Put the vertex.
+                v = vec3(vert->pos.x * scale,
+                         vert->pos.y * scale,
+                         vert->pos.z * scale);
                 v = mat4_mul_vec3(mat, v);
-                c = verts[i * 4 + j].color.rgb;
+                c = vert->color.rgb;
                 line = (line_t){"v ", .v = v, .c = c};
                 face.vs[j] = lines_add(lines, &line);
-            }
-            // Put the normals
-            for (j = 0; j < 4; j++) {
-                v = vec3(verts[i * 4 + j].normal.x,
-                         verts[i * 4 + j].normal.y,
-                         verts[i * 4 + j].normal.z);
+                // Put the normal.
+                v = vec3(vert->normal.x, vert->normal.y, vert->normal.z);
+                if (indices) vec3_normalize(&v);
                 line = (line_t){"vn", .vn = v};
                 face.vns[j] = lines_add(lines, &line);
             }
             lines_add(lines, &face);
         }
     }
+    free(verts);
+    free(indices);
+}
+
+void wavefront_export(const mesh_t *mesh, const char *path, int effects)
+{
+    // XXX: Merge faces that can be merged into bigger ones.
+    //      Allow to chose between quads or triangles.
+    //      Also export mlt file for the colors.
+    FILE *out;
+    UT_array *lines;
+    line_t *line_ptr;
+    int i;
+
+    utarray_new(lines, &line_icd);
+    get_lines(mesh, effects, lines);
     out = fopen(path, "w");
     fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
     line_ptr = NULL;
@@ -132,62 +165,25 @@ void wavefront_export(const mesh_t *mesh, const char *path)
             fprintf(out, "vn %g %g %g\n", VEC3_SPLIT(line_ptr->vn));
     }
     while( (line_ptr = (line_t*)utarray_next(lines, line_ptr))) {
-        if (strncmp(line_ptr->type, "f ", 2) == 0)
-            fprintf(out, "f %d//%d %d//%d %d//%d %d//%d\n",
-                         line_ptr->vs[0], line_ptr->vns[0],
-                         line_ptr->vs[1], line_ptr->vns[1],
-                         line_ptr->vs[2], line_ptr->vns[2],
-                         line_ptr->vs[3], line_ptr->vns[3]);
+        if (strncmp(line_ptr->type, "f ", 2) != 0) continue;
+        fprintf(out, "f");
+        for (i = 0; i < 4 && line_ptr->vs[i]; i++)
+            fprintf(out, " %d//%d", line_ptr->vs[i], line_ptr->vns[i]);
+        fprintf(out, "\n");
     }
     fclose(out);
     utarray_free(lines);
-    free(verts);
 }
 
-void ply_export(const mesh_t *mesh, const char *path)
+void ply_export(const mesh_t *mesh, const char *path, int effects)
 {
-    block_t *block;
-    voxel_vertex_t* verts;
-    vec3_t v;
-    uvec3b_t c;
-    int nb_quads, i, j;
-    mat4_t mat;
     FILE *out;
-    const int N = BLOCK_SIZE;
     UT_array *lines;
-    line_t line, face, *line_ptr;
+    line_t *line_ptr;
+    int i, n;
 
     utarray_new(lines, &line_icd);
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    face = (line_t){"f "};
-    MESH_ITER_BLOCKS(mesh, block) {
-        mat = mat4_identity;
-        mat4_itranslate(&mat, block->pos.x, block->pos.y, block->pos.z);
-        mat4_itranslate(&mat, -N / 2 + 0.5, -N / 2 + 0.5, -N / 2 + 0.5);
-
-        nb_quads = block_generate_vertices(block->data, 0, 0, verts);
-        for (i = 0; i < nb_quads; i++) {
-            // Put the vertices.
-            for (j = 0; j < 4; j++) {
-                v = vec3(verts[i * 4 + j].pos.x,
-                         verts[i * 4 + j].pos.y,
-                         verts[i * 4 + j].pos.z);
-                v = mat4_mul_vec3(mat, v);
-                c = verts[i * 4 + j].color.rgb;
-                line = (line_t){"v ", .v = v, .c = c};
-                face.vs[j] = lines_add(lines, &line);
-            }
-            // Put the normals
-            for (j = 0; j < 4; j++) {
-                v = vec3(verts[i * 4 + j].normal.x,
-                         verts[i * 4 + j].normal.y,
-                         verts[i * 4 + j].normal.z);
-                line = (line_t){"vn", .vn = v};
-                face.vns[j] = lines_add(lines, &line);
-            }
-            lines_add(lines, &face);
-        }
-    }
+    get_lines(mesh, effects, lines);
     out = fopen(path, "w");
     fprintf(out, "ply\n");
     fprintf(out, "format ascii 1.0\n");
@@ -210,15 +206,15 @@ void ply_export(const mesh_t *mesh, const char *path)
                     VEC3_SPLIT(line_ptr->c));
     }
     while( (line_ptr = (line_t*)utarray_next(lines, line_ptr))) {
-        if (strncmp(line_ptr->type, "f ", 2) == 0)
-            fprintf(out, "4 %d %d %d %d\n", line_ptr->vs[0] - 1,
-                                            line_ptr->vs[1] - 1,
-                                            line_ptr->vs[2] - 1,
-                                            line_ptr->vs[3] - 1);
+        if (strncmp(line_ptr->type, "f ", 2) != 0) continue;
+        n = line_ptr->vs[3] ? 4 : 3;
+        fprintf(out, "%d", n);
+        for (i = 0; i < n; i++)
+            fprintf(out, " %d", line_ptr->vs[i] - 1);
+        fprintf(out, "\n");
     }
     fclose(out);
     utarray_free(lines);
-    free(verts);
 }
 
 static void export_as_obj(const char *path)
@@ -226,7 +222,8 @@ static void export_as_obj(const char *path)
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                     "obj\0*.obj\0", NULL, "untitled.obj");
     if (!path) return;
-    wavefront_export(goxel->layers_mesh, path);
+    wavefront_export(goxel->layers_mesh, path,
+                     goxel->rend.settings.effects);
 }
 
 ACTION_REGISTER(export_as_obj,
@@ -244,7 +241,7 @@ static void export_as_ply(const char *path)
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                     "ply\0*.ply\0", NULL, "untitled.ply");
     if (!path) return;
-    ply_export(goxel->layers_mesh, path);
+    ply_export(goxel->layers_mesh, path, goxel->rend.settings.effects);
 }
 
 ACTION_REGISTER(export_as_ply,
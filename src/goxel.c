@@ -21,22 +21,6 @@
 
 goxel_t *goxel = NULL;
 
-static void unpack_pos_data(uint32_t v, vec3b_t *pos, int *face,
-                            int *cube_id)
-{
-    assert(BLOCK_SIZE == 16);
-    int x, y, z, f, i;
-    x = v >> 28;
-    y = (v >> 24) & 0x0f;
-    z = (v >> 20) & 0x0f;
-    f = (v >> 16) & 0x0f;
-    i = v & 0xffff;
-    assert(f < 6);
-    *pos = vec3b(x, y, z);
-    *face = f;
-    *cube_id = i;
-}
-
 // XXX: can we merge this with unproject?
 static vec3_t unproject_delta(const vec3_t *win, const mat4_t *model,
                               const mat4_t *proj, const vec4_t *view)
@@ -113,55 +97,13 @@ bool goxel_unproject_on_mesh(goxel_t *goxel, const vec4_t *view,
                              const vec2_t *pos, mesh_t *mesh,
                              vec3_t *out, vec3_t *normal)
 {
-    vec2_t view_size = view->zw;
-    // XXX: No need to render the fbo if it is not dirty.
-    if (goxel->pick_fbo && !vec2_equal(
-                vec2(goxel->pick_fbo->w, goxel->pick_fbo->h), view_size)) {
-        texture_delete(goxel->pick_fbo);
-        goxel->pick_fbo = NULL;
-    }
-
-    if (!goxel->pick_fbo) {
-        goxel->pick_fbo = texture_new_buffer(
-                view_size.x, view_size.y, TF_DEPTH);
-    }
-
-    renderer_t rend = {
-        .view_mat = goxel->rend.view_mat,
-        .proj_mat = goxel->rend.proj_mat,
-        .settings = goxel->rend.settings,
-    };
-    uint32_t pixel;
-    vec3b_t voxel_pos;
-    block_t *block;
-    int face, block_id;
-    int x, y;
-    int rect[4] = {0, 0, view_size.x, view_size.y};
-
-    rend.settings.shadow = 0;
-    rend.fbo = goxel->pick_fbo->framebuffer;
-    render_mesh(&rend, mesh, EFFECT_RENDER_POS);
-
-    render_render(&rend, rect, &vec4_zero);
-
-    x = round(pos->x - view->x);
-    y = round(pos->y - view->y);
-    GL(glViewport(0, 0, goxel->screen_size.x, goxel->screen_size.y));
-    if (x < 0 || x >= view_size.x ||
-        y < 0 || y >= view_size.y) return false;
-    GL(glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &pixel));
-
-    unpack_pos_data(pixel, &voxel_pos, &face, &block_id);
-    if (!block_id) return false;
-    MESH_ITER_BLOCKS(mesh, block) {
-        if (block->id == block_id) break;
-    }
-    assert(block);
-    *out = vec3(block->pos.x + voxel_pos.x - BLOCK_SIZE / 2 + 0.5,
-                block->pos.y + voxel_pos.y - BLOCK_SIZE / 2 + 0.5,
-                block->pos.z + voxel_pos.z - BLOCK_SIZE / 2 + 0.5);
-    *normal = vec3(VEC3_SPLIT(FACES_NORMALS[face]));
-    return true;
+    PROFILED;
+    vec3_t opos, onorm;
+    if (pos->x < view->x || pos->x >= view->x + view->z ||
+        pos->y < view->y || pos->y >= view->y + view->w) return false;
+    camera_get_ray(&goxel->camera, pos, view, &opos, &onorm);
+    return mesh_raycast(mesh, &opos, &onorm, INFINITY, out, normal,
+                        NULL, NULL);
 }
 
 int goxel_unproject(goxel_t *goxel, const vec4_t *view,
@@ -226,13 +168,14 @@ int goxel_unproject(goxel_t *goxel, const vec4_t *view,
     return ret;
 }
 
-void goxel_init(goxel_t *gox)
+static void goxel_init_(goxel_t *gox, bool headless)
 {
     goxel = gox;
     memset(goxel, 0, sizeof(*goxel));
     goxel->next_uid = 1; // 0 should never be used.
+    goxel->headless = headless;
 
-    render_init();
+    if (!headless) render_init();
     shapes_init();
     goxel->camera.ofs = vec3_zero;
     goxel->camera.rot = quat_identity;
@@ -278,20 +221,35 @@ void goxel_init(goxel_t *gox)
     };
     render_get_default_settings(0, NULL, &goxel->rend.settings);
 
-    model3d_init();
     goxel->plane = plane(vec3(0.5, 0.5, 0.5), vec3(1, 0, 0), vec3(0, 1, 0));
     goxel->snap = SNAP_PLANE | SNAP_MESH | SNAP_IMAGE_BOX;
-    gui_init();
+    if (!headless) {
+        model3d_init();
+        gui_init();
+    }
+}
+
+void goxel_init(goxel_t *gox)
+{
+    goxel_init_(gox, false);
+}
+
+void goxel_init_headless(goxel_t *gox)
+{
+    goxel_init_(gox, true);
 }
 
 void goxel_release(goxel_t *goxel)
 {
     proc_release(&goxel->proc);
-    gui_release();
+    if (!goxel->headless) gui_release();
 }
 
 void goxel_iter(goxel_t *goxel, inputs_t *inputs)
 {
+    profiler_tick();
+    PROFILED;
+    render_new_frame(&goxel->rend);
     goxel->frame_clock = get_clock();
     goxel_set_help_text(goxel, NULL);
     goxel_set_hint_text(goxel, NULL);
@@ -474,6 +432,7 @@ void goxel_render_view(goxel_t *goxel, const vec4_t *rect)
 
 void goxel_update_meshes(goxel_t *goxel, int mask)
 {
+    PROFILED;
     layer_t *layer;
     if (mask & MESH_LAYERS) {
         mesh_clear(goxel->layers_mesh);
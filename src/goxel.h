@@ -280,6 +280,15 @@ uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp,
                           int *size);
 void img_downsample(const uint8_t *img, int w, int h, int bpp,
                     uint8_t *out);
+
+// Png writer that takes the rows progressively, so that we never need the
+// whole image in memory.
+typedef struct png_writer png_writer_t;
+png_writer_t *png_writer_create(const char *path, int w, int h, int bpp);
+// Add nb rows, from the top to the bottom of the image.
+void png_writer_write(png_writer_t *png, const uint8_t *rows, int nb);
+// Close the file and free the writer.  Return 0 on success.
+int png_writer_finish(png_writer_t *png);
 bool str_endswith(const char *str, const char *end);
 bool str_startswith(const char *s1, const char *s2);
 
@@ -298,6 +307,76 @@ int list_dir(const char *url, int flags, void *user,
 vec3_t unproject(const vec3_t *win, const mat4_t *model,
                  const mat4_t *proj, const vec4_t *view);
 
+// Return the number of cpus we can use for threads.
+int get_nb_cpus(void);
+
+// Return the peak resident memory of the process in bytes, or 0 if we
+// don't know it.
+int64_t get_peak_memory(void);
+
+// Call f(i, user) for all i in [0, n), using a pool of one thread per cpu.
+// Return once all the calls are done.  The order of the calls is undefined.
+void parallel_for(int n, void (*f)(int i, void *user), void *user);
+
+// #############################
+
+
+// #### Profiler ###############
+// Scoped timers, to see where the time goes in a frame.  Put PROFILED (or
+// PROFILED2(name)) at the beginning of a block of code, and the time until
+// the end of the block gets added to a global counter with the given name.
+// Safe to use from several threads.
+
+#define PROFILER_HISTORY 256 // Number of frames we keep.
+
+typedef struct profiler_block profiler_block_t;
+struct profiler_block {
+    const char          *name;
+    profiler_block_t    *next;
+    int                 registered;
+    int64_t             time;       // Current frame time (ns).
+    int                 count;      // Current frame number of calls.
+    int64_t             frame_time; // Time of the last frame (ns).
+    int                 frame_count;
+    double              avg_time;   // Rolling average of frame_time.
+    int64_t             total_time;
+    int64_t             total_count;
+    int64_t             history[PROFILER_HISTORY];
+};
+
+typedef struct {
+    profiler_block_t *block;
+    int64_t          start;
+} profiler_scope_t;
+
+void profiler_leave_(profiler_scope_t *scope);
+
+#define PROFILED2(name_) \
+    static profiler_block_t PROFILER_BLOCK_ = {name_}; \
+    profiler_scope_t PROFILER_SCOPE_ \
+        __attribute__((cleanup(profiler_leave_))) = \
+        {&PROFILER_BLOCK_, get_clock()}
+
+#define PROFILED PROFILED2(__func__)
+
+// To call at the beginning of each frame.
+void profiler_tick(void);
+// Return the list of all the blocks, sorted by names.
+profiler_block_t *profiler_get_blocks(void);
+// Time between the two last ticks (ns).
+int64_t profiler_get_frame_time(void);
+
+// Tracing: while active, all the profiled scopes and the actions are also
+// recorded with their thread, and can be saved in the Chrome trace event
+// json format (for chrome://tracing or Perfetto).
+void profiler_trace_start(void);
+// Stop the tracing and save the events into a json file.
+int profiler_trace_stop(const char *path);
+bool profiler_is_tracing(void);
+// Record an event if we are tracing.  name and cat must be static strings.
+void profiler_trace_event(const char *name, const char *cat,
+                          int64_t start, int64_t end);
+
 // #############################
 
 
@@ -508,6 +587,7 @@ typedef struct painter {
     const shape_t   *shape;
     uvec4b_t        color;
     float           smoothness;
+    const box_t     *box;   // Clipping box (can be NULL).
 } painter_t;
 
 // #### Block ##################
@@ -525,7 +605,6 @@ typedef struct voxel_vertex
     vec3b_t  pos        __attribute__((aligned(4)));
     vec3b_t  normal     __attribute__((aligned(4)));
     uvec4b_t color      __attribute__((aligned(4)));
-    uint32_t pos_data   __attribute__((aligned(4)));
     uvec2b_t uv         __attribute__((aligned(4)));
     uvec2b_t bshadow_uv __attribute__((aligned(4)));
     uvec2b_t bump_uv    __attribute__((aligned(4)));
@@ -538,6 +617,9 @@ struct block_data
 {
     int         ref;
     uint64_t    id;
+    // Cache of block_get_solid_borders, with the bit 6 set once computed.
+    // Reset each time the data is written.
+    int         solid_borders;
     uvec4b_t    voxels[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE]; // RGBA voxels.
 };
 
@@ -547,20 +629,54 @@ struct block
     UT_hash_handle  hh;     // The hash table of pos -> blocks in a mesh.
     block_data_t    *data;
     vec3i_t         pos;
-    int             id;     // id of the block in the mesh it belongs.
 };
 block_t *block_new(const vec3i_t *pos, block_data_t *data);
 void block_delete(block_t *block);
 block_t *block_copy(const block_t *other);
+void block_set_data(block_t *block, block_data_t *data);
 box_t block_get_box(const block_t *block, bool exact);
 void block_fill(block_t *block,
                 uvec4b_t (*get_color)(const vec3_t *pos, void *user_data),
                 void *user_data);
 int block_generate_vertices(const block_data_t *data, int effects,
-                            int block_id, voxel_vertex_t *out);
+                            voxel_vertex_t *out);
+// Lower resolution version for far away blocks, with the voxels merged by
+// groups of 2^level (1 to BLOCK_LOD_MAX).  The LOD data is cached by the
+// block data id.
+#define BLOCK_LOD_MAX 3
+int block_generate_vertices_lod(const block_data_t *data, int level,
+                                voxel_vertex_t *out);
+// Marching cube version, generating indexed triangles.  Return the number
+// of vertices, and set nb_indices to the number of indices.
+//  out:     room for at least BLOCK_MC_MAX_VERTICES vertices.
+//  indices: room for at least BLOCK_MC_MAX_INDICES indices.
+#define BLOCK_MC_MAX_VERTICES ((BLOCK_SIZE - 2) * (BLOCK_SIZE - 2) * \
+                               (BLOCK_SIZE - 2) * 12)
+#define BLOCK_MC_MAX_INDICES  ((BLOCK_SIZE - 2) * (BLOCK_SIZE - 2) * \
+                               (BLOCK_SIZE - 2) * 18)
+int block_generate_vertices_mc(const block_data_t *data, int effects,
+                               voxel_vertex_t *out, uint16_t *indices,
+                               int *nb_indices);
+// Same as block_generate_vertices_mc, using surface nets.
+int block_generate_vertices_sn(const block_data_t *data, int effects,
+                               voxel_vertex_t *out, uint16_t *indices,
+                               int *nb_indices);
+// Mask of the faces (in the FACES_NORMALS order) whose border layer of
+// voxels, that is the side of the neighbor block, is fully solid.
+int block_get_solid_borders(const block_t *block);
+// True if the block is fully enclosed by solid voxels, so that none of its
+// faces can be seen from outside.
+bool block_is_hidden(const block_t *block);
 void block_op(block_t *block, painter_t *painter, const box_t *box);
 bool block_is_empty(const block_t *block, bool fast);
 void block_merge(block_t *block, const block_t *other, int op);
+// Merge with MODE_OVER the interior voxels of a block data put at a given
+// block position (not necessarily aligned with the blocks grid).
+void block_stamp(block_t *block, const block_data_t *data, const vec3i_t *pos);
+// Test if block_stamp gives the same voxels as the MODE_OVER ops that made
+// the data: its translucent voxels can only be merged over empty voxels.
+bool block_can_stamp(const block_t *block, const block_data_t *data,
+                     const vec3i_t *pos);
 uvec4b_t block_get_at(const block_t *block, const vec3_t *pos);
 void block_set_at(block_t *block, const vec3_t *pos, uvec4b_t v);
 
@@ -577,7 +693,6 @@ typedef struct mesh mesh_t;
 struct mesh
 {
     block_t *blocks;
-    int next_block_id;
     int *ref;   // Used to implement copy on write of the blocks.
     uint64_t id;     // global uniq id, change each time a mesh changes.
 };
@@ -588,12 +703,48 @@ mesh_t *mesh_copy(const mesh_t *mesh);
 void mesh_set(mesh_t *mesh, const mesh_t *other);
 box_t mesh_get_box(const mesh_t *mesh, bool exact);
 void mesh_op(mesh_t *mesh, painter_t *painter, const box_t *box);
+
+// Queue of operations, that gives the same result as calling mesh_op for
+// each of them, but faster when we have a lot of small operations.
+// The operations are applied in mesh_op_batch_apply.
+typedef struct mesh_op_batch mesh_op_batch_t;
+mesh_op_batch_t *mesh_op_batch_new(void);
+void mesh_op_batch_delete(mesh_op_batch_t *batch);
+void mesh_op_batch_add(mesh_op_batch_t *batch, mesh_t *mesh,
+                       const painter_t *painter, const box_t *box);
+void mesh_op_batch_apply(mesh_op_batch_t *batch);
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int op);
+// Merge a mesh made with MODE_OVER ops, translated by an integer offset.
+// The result is exactly the same as running the ops translated by the
+// offset, or if it can't be, because some translucent voxels would be
+// merged over non empty ones, the function returns false without changing
+// the mesh.  Where the offset is aligned with the blocks, the new blocks
+// share the other mesh data.
+bool mesh_stamp(mesh_t *mesh, const mesh_t *other, const vec3i_t *offset);
 block_t *mesh_add_block(mesh_t *mesh, block_data_t *data, const vec3i_t *pos);
 void mesh_move(mesh_t *mesh, const mat4_t *mat);
 uvec4b_t mesh_get_at(const mesh_t *mesh, const vec3_t *pos);
 void mesh_set_at(mesh_t *mesh, const vec3_t *pos, uvec4b_t v);
 void mesh_remove_empty_blocks(mesh_t *mesh);
+// Find the first voxel hit by a ray.
+//   o, d:      ray origin and direction.
+//   max_dist:  maximum distance along the ray, in units of d.
+//   pos:       center of the hit voxel.
+//   normal:    normal of the hit face.
+//   color:     color of the hit voxel.
+//   dist:      distance of the hit face along the ray, in units of d.
+// All the output arguments can be NULL.
+bool mesh_raycast(const mesh_t *mesh, const vec3_t *o, const vec3_t *d,
+                  float max_dist, vec3_t *pos, vec3_t *normal,
+                  uvec4b_t *color, float *dist);
+// Bounding voxels [lo, hi] of all the blocks of a mesh.
+void mesh_get_blocks_bounds(const mesh_t *mesh, int lo[3], int hi[3]);
+// Same as mesh_raycast, with the bounds from mesh_get_blocks_bounds, so
+// that we don't recompute them for each ray when we cast a lot of rays.
+bool mesh_raycast_bounded(const mesh_t *mesh, const int lo[3],
+                          const int hi[3], const vec3_t *o, const vec3_t *d,
+                          float max_dist, vec3_t *pos, vec3_t *normal,
+                          uvec4b_t *color, float *dist);
 
 // XXX: clean up this.  We should use a struct to represent a data cube.
 void mesh_blit(mesh_t *mesh, uvec4b_t *data,
@@ -624,7 +775,6 @@ void mesh_shift_alpha(mesh_t *mesh, int v);
 // #### Renderer ###############
 
 enum {
-    EFFECT_RENDER_POS       = 1 << 1,
     EFFECT_SMOOTH           = 1 << 2,
     EFFECT_BORDERS          = 1 << 3,
     EFFECT_BORDERS_ALL      = 1 << 4,
@@ -638,6 +788,12 @@ enum {
     EFFECT_NO_SHADING       = 1 << 10,
     EFFECT_STRIP            = 1 << 11,
     EFFECT_WIREFRAME        = 1 << 12,
+
+    // Smooth mesh, alternative to the marching cubes.
+    EFFECT_SURFACE_NETS     = 1 << 13,
+
+    // The effects that render the blocks as smooth triangle meshes.
+    EFFECT_SMOOTH_MESH      = EFFECT_MARCHING_CUBES | EFFECT_SURFACE_NETS,
 };
 
 typedef struct {
@@ -649,6 +805,9 @@ typedef struct {
     float shadow;
     int   effects;
     float border_shadow;
+    // Size of a voxel in pixels under which we render the blocks with a
+    // lower LOD.  Zero to disable.
+    float lod;
 } render_settings_t;
 
 typedef struct renderer renderer_t;
@@ -689,10 +848,45 @@ void render_rect(renderer_t *rend, const plane_t *plane, int effects);
 //  clear_color: clear the screen with this first.
 void render_render(renderer_t *rend, const int rect[4],
                    const vec4_t *clear_color);
+// Must be called once per frame, after all the renderers queues have been
+// flushed.  Release the memory of the queued items, and the items of rend
+// that have not been rendered.
+void render_new_frame(renderer_t *rend);
 int render_get_default_settings(int i, char **name, render_settings_t *out);
 // Compute the light direction in the model coordinates (toward the light)
 vec3_t render_get_light_dir(const renderer_t *rend);
 
+// Statistics of the blocks vertex buffers cache.
+typedef struct {
+    int     nb_items;   // Number of resident buffers.
+    int64_t size;       // Total size of the buffers in bytes.
+    int     evictions;  // Number of buffers evicted during the last frame.
+} render_cache_stats_t;
+
+// Border shadow value of a point of a voxel face, as used in the border
+// shadow texture.
+float render_get_border_dist(float x, float y, int mask);
+
+// Render a mesh on the CPU, without OpenGL.
+//  out: RGBA buffer of size w * h * 4, with the first row at the top.
+void render_soft(const renderer_t *rend, const mesh_t *mesh,
+                 int w, int h, uint8_t *out);
+
+// CPU path tracer, using the renderer matrices, light and settings.
+typedef struct pathtracer pathtracer_t;
+pathtracer_t *pathtracer_create(const renderer_t *rend, const mesh_t *mesh,
+                                int w, int h);
+void pathtracer_delete(pathtracer_t *pt);
+// Add one sample per pixel.
+void pathtracer_iter(pathtracer_t *pt);
+int pathtracer_get_samples(const pathtracer_t *pt);
+// Get the current image as RGBA, with the first row at the top.
+void pathtracer_get_image(const pathtracer_t *pt, uint8_t *out);
+
+// Set the memory budget (in bytes) of the blocks vertex buffers cache.
+void render_set_cache_size(int64_t size);
+void render_get_cache_stats(render_cache_stats_t *stats);
+
 // #############################
 
 
@@ -891,12 +1085,41 @@ enum {
     PROC_DONE,
 };
 
+typedef struct {
+    float            max_op_volume; // Max volume of a shape (0 for default).
+    struct {
+        bool         enabled;
+        box_t        box;
+    } clip; // If enabled, skip the shapes outside the box.
+    bool             instancing; // Voxelize the invariant shapes only once.
+} proc_options_t;
+
 typedef struct proc {
     struct proc_node *prog; // AST of the program.
     struct proc_ctx  *ctxs; // Rendering stack during execution.
-    int              state;
+    int              state; // Atomic, since the thread can change it.
     int              frame; // Rendering frame.
     bool             in_frame; // Set if the current frame is not finished.
+    // The options can be changed at any time, the running program uses
+    // the copy made in proc_start.
+    proc_options_t   options;
+    proc_options_t   run_options;
+    mesh_op_batch_t  *batch; // Shapes emitted during the current frame.
+    struct proc_template *templates; // Voxelized invariant shapes.
+    painter_t        painter; // Painter used for the shapes.
+    struct proc_thread *thread; // Set if running in a background thread.
+    struct {
+        struct proc_ctx_chunk *chunks;
+        struct proc_ctx  *free;
+        int              lock;
+    } pool; // Allocator of the contexts.
+    struct {
+        int          nb_ctxs;   // Number of live contexts.
+        int          peak_ctxs; // Max number of live contexts since start.
+        int64_t      nb_iters;  // Number of expanded contexts.
+        int64_t      nb_ops;    // Number of mesh ops (one per shape).
+        int64_t      nb_instances; // Number of merged templates.
+    } stats;
     struct {
         char         *str;  // Set in case of parsing or execution error.
         int          line;
@@ -908,6 +1131,15 @@ void proc_release(gox_proc_t *proc);
 int proc_start(gox_proc_t *proc, const box_t *box);
 int proc_stop(gox_proc_t *proc);
 int proc_iter(gox_proc_t *proc);
+// Run the program in a background thread, on a private copy of a mesh.
+// The state of the mesh is regularly published, and copied back by
+// proc_sync.  Return -1 if we don't support threads.
+int proc_run_async(gox_proc_t *proc, const mesh_t *mesh);
+// Copy the last published state of the background thread into a mesh (or
+// just discard it if mesh is NULL).  Return true if the mesh changed.
+bool proc_sync(gox_proc_t *proc, mesh_t *mesh);
+// Run the program until the end, without splitting it in frames.
+int proc_run(gox_proc_t *proc);
 
 // Get the list of programs saved in data/procs.
 int proc_list_examples(void (*f)(int index,
@@ -942,7 +1174,6 @@ typedef struct goxel
     uvec4b_t   grid_color;
     uvec4b_t   image_box_color;
 
-    texture_t  *pick_fbo;
     painter_t  painter;
     renderer_t rend;
 
@@ -982,12 +1213,15 @@ typedef struct goxel
 
     int        block_count; // Counter for the number of block data.
     bool       quit;        // Set to true to quit the application.
+    bool       headless;    // Set if we don't have any OpenGL context.
 } goxel_t;
 
 // the global goxel instance.
 extern goxel_t *goxel;
 
 void goxel_init(goxel_t *goxel);
+// Init without any OpenGL context or GUI, for command line operations.
+void goxel_init_headless(goxel_t *goxel);
 void goxel_release(goxel_t *goxel);
 void goxel_iter(goxel_t *goxel, inputs_t *inputs);
 void goxel_render(goxel_t *goxel);
@@ -1100,8 +1334,10 @@ void gui_enabled_end(void);
 
 // #############################
 
-void wavefront_export(const mesh_t *mesh, const char *path);
-void ply_export(const mesh_t *mesh, const char *path);
+// If effects include EFFECT_MARCHING_CUBES or EFFECT_SURFACE_NETS, export
+// the smooth mesh as triangles instead of the voxel quads.
+void wavefront_export(const mesh_t *mesh, const char *path, int effects);
+void ply_export(const mesh_t *mesh, const char *path, int effects);
 
 // ##### Assets manager ########################
 // All the assets are saved in binary directly in the code, using
@@ -1130,9 +1366,17 @@ void mustache_free(mustache_t *m);
 // Allow to cache blocks merge operations.
 typedef struct cache cache_t;
 
-cache_t *cache_create(int size);
+cache_t *cache_create(int64_t size);
 void cache_add(cache_t *cache, const void *key, int keylen, void *data,
                int cost, int (*delfunc)(void *data));
 void *cache_get(cache_t *cache, const void *key, int keylen);
+// Change the maximum size, removing old items if needed.
+void cache_set_max_size(cache_t *cache, int64_t size);
+// Return the sum of the costs of all the items in the cache.
+int64_t cache_get_size(const cache_t *cache);
+// Remove the least recently used items for as long as 'expired' returns
+// true.  Return the number of removed items.
+int cache_evict(cache_t *cache, bool (*expired)(void *data, void *user),
+                void *user);
 
 #endif // GOXEL_H
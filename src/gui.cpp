@@ -552,6 +552,11 @@ static void render_advanced_panel(goxel_t *goxel)
 #undef MAT_FLOAT
     ImGui::GoxGroupEnd();
 
+    // Voxel size in pixels under which we use the lower resolution meshes.
+    v = goxel->rend.settings.lod;
+    if (ImGui::GoxInputFloat("LOD", &v, 0.1, 0, 8))
+        goxel->rend.settings.lod = clamp(v, 0, 8);
+
     ImGui::CheckboxFlags("Borders",
             (unsigned int*)&goxel->rend.settings.effects, EFFECT_BORDERS);
     ImGui::CheckboxFlags("Borders all",
@@ -560,6 +565,12 @@ static void render_advanced_panel(goxel_t *goxel)
             (unsigned int*)&goxel->rend.settings.effects, EFFECT_SEE_BACK);
     if (ImGui::CheckboxFlags("Marching Cubes",
             (unsigned int*)&goxel->rend.settings.effects, EFFECT_MARCHING_CUBES)) {
+        goxel->rend.settings.effects &= ~EFFECT_SURFACE_NETS;
+        goxel->rend.settings.smoothness = 1;
+    }
+    if (ImGui::CheckboxFlags("Surface Nets",
+            (unsigned int*)&goxel->rend.settings.effects, EFFECT_SURFACE_NETS)) {
+        goxel->rend.settings.effects &= ~EFFECT_MARCHING_CUBES;
         goxel->rend.settings.smoothness = 1;
     }
     if (goxel->rend.settings.effects & EFFECT_MARCHING_CUBES)
@@ -612,9 +623,9 @@ static void render_panel(goxel_t *goxel)
 static void export_panel(goxel_t *goxel)
 {
     int i;
-    int maxsize;
-    GL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize));
-    maxsize /= 2; // Because png export already double it.
+    // The png export renders the image by tiles, so we are not limited by
+    // the max texture size.
+    const int maxsize = 1 << 15;
     goxel->show_export_viewport = true;
     ImGui::GoxGroupBegin();
     i = goxel->image->export_width;
@@ -973,6 +984,15 @@ void gui_iter(goxel_t *goxel, const inputs_t *inputs)
         ImGui::Text("Blocks: %d (%.2g MiB)", goxel->block_count,
                 (float)goxel->block_count * sizeof(block_data_t) / MiB);
         ImGui::Text("uid: %lu", (unsigned long)goxel->next_uid);
+        render_cache_stats_t stats;
+        render_get_cache_stats(&stats);
+        ImGui::Text("Render cache: %d (%.2g MiB), evicted: %d",
+                    stats.nb_items, (float)stats.size / MiB, stats.evictions);
+        ImGui::Text("Frame: %.1f ms", profiler_get_frame_time() / 1e6);
+        for (profiler_block_t *b = profiler_get_blocks(); b; b = b->next) {
+            ImGui::Text("  %-24s %6.2f ms (%d)", b->name,
+                        b->avg_time / 1e6, b->frame_count);
+        }
         ImGui::EndChild();
     }
 
@@ -1032,6 +1052,7 @@ void gui_iter(goxel_t *goxel, const inputs_t *inputs)
 
 void gui_render(void)
 {
+    PROFILED;
     ImGui::Render();
 }
 
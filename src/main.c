@@ -61,8 +61,27 @@ typedef struct
 {
     char *input;
     char *export;
+    int  cache_size; // In MiB.
+    int  samples;    // If set, export with the path tracer.
+    char *trace;     // If set, save a trace of the session to this file.
+    bool bench;      // Run the input program and only print the stats.
+    // Procedural programs options.
+    int     seed;
+    vec3_t  box;        // Size of the initial box.
+    float   max_volume; // Max volume of a single shape.
+    bool    clip;
+    vec3_t  clip_box[2]; // Min and max corners of the clip volume.
+    bool    instances;
 } args_t;
 
+enum {
+    OPT_SEED = 256,
+    OPT_BOX,
+    OPT_MAX_VOLUME,
+    OPT_CLIP,
+    OPT_INSTANCES,
+};
+
 #ifndef NO_ARGP
 #include <argp.h>
 
@@ -72,6 +91,24 @@ static char doc[] = "A 3D voxels editor";
 static char args_doc[] = "[INPUT]";
 static struct argp_option options[] = {
     {"export",   'e', "FILENAME", 0, "Export the model to a file" },
+    {"cache-size", 'c', "MIB", 0,
+        "Memory budget of the blocks render cache (default 1024)" },
+    {"samples", 's', "N", 0,
+        "Export a png with the path tracer, using N samples per pixel" },
+    {"trace", 't', "FILENAME", 0,
+        "Save a Chrome trace (json) of the session to a file" },
+    {"bench", 'b', NULL, 0,
+        "Run a procedural program (.goxcf input) and print the stats" },
+    {"seed", OPT_SEED, "N", 0,
+        "Random seed of the procedural program (.goxcf input)" },
+    {"box", OPT_BOX, "W,H,D", 0,
+        "Size of the initial box of the procedural program (default 1,1,1)" },
+    {"max-volume", OPT_MAX_VOLUME, "V", 0,
+        "Abort the procedural program if a shape is bigger than V voxels" },
+    {"clip", OPT_CLIP, "X0,Y0,Z0,X1,Y1,Z1", 0,
+        "Only run the procedural program inside this box" },
+    {"instances", OPT_INSTANCES, NULL, 0,
+        "Voxelize the invariant shapes of the procedural program only once" },
     {},
 };
 
@@ -85,6 +122,47 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'e':
         args->export = arg;
         break;
+    case 'c':
+        args->cache_size = atoi(arg);
+        if (args->cache_size <= 0)
+            argp_error(state, "invalid cache size: %s", arg);
+        break;
+    case 's':
+        args->samples = atoi(arg);
+        if (args->samples <= 0)
+            argp_error(state, "invalid number of samples: %s", arg);
+        break;
+    case 't':
+        args->trace = arg;
+        break;
+    case 'b':
+        args->bench = true;
+        break;
+    case OPT_SEED:
+        args->seed = atoi(arg);
+        break;
+    case OPT_BOX:
+        if (sscanf(arg, "%f,%f,%f", &args->box.x, &args->box.y,
+                   &args->box.z) != 3 ||
+                args->box.x <= 0 || args->box.y <= 0 || args->box.z <= 0)
+            argp_error(state, "invalid box size: %s", arg);
+        break;
+    case OPT_MAX_VOLUME:
+        args->max_volume = atof(arg);
+        if (args->max_volume <= 0)
+            argp_error(state, "invalid max volume: %s", arg);
+        break;
+    case OPT_CLIP:
+        args->clip = true;
+        if (sscanf(arg, "%f,%f,%f,%f,%f,%f",
+                   &args->clip_box[0].x, &args->clip_box[0].y,
+                   &args->clip_box[0].z, &args->clip_box[1].x,
+                   &args->clip_box[1].y, &args->clip_box[1].z) != 6)
+            argp_error(state, "invalid clip box: %s", arg);
+        break;
+    case OPT_INSTANCES:
+        args->instances = true;
+        break;
     case ARGP_KEY_ARG:
         if (state->arg_num >= 1)
             argp_usage(state);
@@ -137,6 +215,83 @@ static void loop_function(void) {
     glfwPollEvents();
 }
 
+// Hash of all the voxels of a mesh, that doesn't depend on the order of
+// the blocks.
+static uint64_t mesh_hash(const mesh_t *mesh, int64_t *nb_voxels)
+{
+    const block_t *block;
+    int x, y, z;
+    uvec4b_t v;
+    uint64_t h, ret = 0;
+
+    *nb_voxels = 0;
+    MESH_ITER_VOXELS(mesh, block, x, y, z, v) {
+        h = (uint32_t)(block->pos.x + x) * 73856093ULL ^
+            (uint32_t)(block->pos.y + y) * 19349663ULL ^
+            (uint32_t)(block->pos.z + z) * 83492791ULL;
+        h = (h ^ v.uint32) * 0x9E3779B97F4A7C15ULL;
+        ret += h ^ (h >> 29);
+        (*nb_voxels)++;
+    }
+    return ret;
+}
+
+// Run a procedural program in the current layer, and print some stats.
+static int run_proc(const args_t *args)
+{
+    gox_proc_t *proc = &goxel->proc;
+    const mesh_t *mesh = goxel->image->active_layer->mesh;
+    const block_t *block;
+    char *txt;
+    box_t box;
+    int64_t t0, t1, t2, nb_voxels;
+    int nb_blocks = 0;
+    uint64_t hash;
+
+    txt = read_file(args->input, NULL);
+    if (!txt) {
+        LOG_E("Cannot read %s", args->input);
+        return -1;
+    }
+    t0 = get_clock();
+    proc_parse(txt, proc);
+    free(txt);
+    if (proc->state == PROC_PARSE_ERROR) goto error;
+    t1 = get_clock();
+    box = bbox_from_extents(vec3_zero, 0.5, 0.5, 0.5);
+    if (args->box.x)
+        box = bbox_from_extents(vec3_zero, args->box.x / 2, args->box.y / 2,
+                                args->box.z / 2);
+    proc->options.max_op_volume = args->max_volume;
+    proc->options.clip.enabled = args->clip;
+    proc->options.clip.box = bbox_from_points(args->clip_box[0],
+                                              args->clip_box[1]);
+    proc->options.instancing = args->instances;
+    srand(args->seed);
+    if (proc_start(proc, &box) || proc_run(proc)) goto error;
+    t2 = get_clock();
+    goxel_update_meshes(goxel, -1);
+
+    MESH_ITER_BLOCKS(mesh, block) nb_blocks++;
+    hash = mesh_hash(mesh, &nb_voxels);
+    LOG_I("%s", args->input);
+    LOG_I("Parse: %.1f ms, run: %.1f ms", (t1 - t0) / 1e6, (t2 - t1) / 1e6);
+    LOG_I("Contexts: %lld (peak %d), mesh ops: %lld, instances: %lld",
+          (long long)proc->stats.nb_iters, proc->stats.peak_ctxs,
+          (long long)proc->stats.nb_ops, (long long)proc->stats.nb_instances);
+    // All the block data still allocated, including the instance templates.
+    LOG_I("Voxels: %lld, mesh blocks: %d, allocated blocks: %d, "
+          "peak memory: %.1f MiB",
+          (long long)nb_voxels, nb_blocks, goxel->block_count,
+          get_peak_memory() / (double)MB);
+    LOG_I("Hash: %016llx", (unsigned long long)hash);
+    return 0;
+
+error:
+    LOG_E("%s:%d: %s", args->input, proc->error.line, proc->error.str);
+    return -1;
+}
+
 #ifndef __EMSCRIPTEN__
 static void start_main_loop(void (*func)(void))
 {
@@ -169,6 +324,33 @@ int main(int argc, char **argv)
 #ifndef NO_ARGP
     argp_parse (&argp, argc, argv, 0, 0, &args);
 #endif
+    if (args.trace) profiler_trace_start();
+
+    // Export and bench from the command line don't need any window.
+    if (args.export || args.bench) {
+        goxel_init_headless(g_goxel);
+        if (args.bench && !args.input) {
+            LOG_E("bench needs a .goxcf input");
+            ret = -1;
+        } else if (!args.input) {
+            LOG_E("trying to export an empty image");
+            ret = -1;
+        } else if (args.bench && !str_endswith(args.input, ".goxcf")) {
+            LOG_E("bench needs a .goxcf input");
+            ret = -1;
+        } else {
+            if (str_endswith(args.input, ".goxcf"))
+                ret = run_proc(&args);
+            else
+                action_exec2("import", "p", args.input);
+            if (ret == 0 && args.export && args.samples)
+                ret = action_exec2("export_as_png_pathtraced", "piii",
+                                   args.export, 0, 0, args.samples);
+            else if (ret == 0 && args.export)
+                ret = action_exec2("export", "p", args.export);
+        }
+        goto end;
+    }
 
     glfwInit();
     glfwWindowHint(GLFW_SAMPLES, 2);
@@ -185,19 +367,13 @@ int main(int argc, char **argv)
 #endif
 
     goxel_init(g_goxel);
+    if (args.cache_size)
+        render_set_cache_size((int64_t)args.cache_size * MB);
     if (args.input)
         action_exec2("import", "p", args.input);
-    if (args.export) {
-        if (!args.input) {
-            LOG_E("trying to export an empty image");
-            ret = -1;
-        } else {
-            ret = action_exec2("export", "p", args.export);
-        }
-        goto end;
-    }
     start_main_loop(loop_function);
 end:
+    if (args.trace) profiler_trace_stop(args.trace);
     goxel_release(g_goxel);
     return ret;
 }
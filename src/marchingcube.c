@@ -20,7 +20,8 @@
 
 static const int N = BLOCK_SIZE;
 
-#define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
+#define DATA_AT(d, x, y, z) (d->voxels[(x) + (y) * N + (z) * N * N])
+#define GRID_IDX(x, y, z) ((x) + (y) * N + (z) * N * N)
 
 #define BLOCK_ITER_INSIDE(x, y, z) \
     for (z = 1; z < N - 1; z++) \
@@ -31,153 +32,277 @@ static const int N = BLOCK_SIZE;
 static const int MC_EDGE_TABLE[256];
 static const int8_t MC_TRI_TABLE[256][16];
 
-// Represent a marching cube triangle vertex, by two vertex index and a factor
-// between them.  If mu = 0, the vertex is at v0, if mu = 1, the vertex is
-// at v1, otherwise the vertex is somewhere in between.
+/*
+ * The cells of the marching cube are the voxels of the block interior, and
+ * the values at the corners of the cells come from the 8 voxels around
+ * each corner.  We first compute the values and the gradients of all the
+ * corners of the block into a grid, so that each corner is only computed
+ * once instead of once per adjacent cell.
+ *
+ * The vertices are on the edges of the grid, and are shared between all
+ * the cells around an edge thanks to an edge cache, so we output indexed
+ * triangles.  In flat mode each cell has its own normal, so we only share
+ * the vertices inside a cell.
+ */
+
 typedef struct {
-    int     v0, v1;
-    float   mu;
-} mc_vert_t;
+    int16_t density[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE];
+    int16_t gradient[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE][3];
+    // Index of the vertex on the edge starting at each grid point, for
+    // each axis, or -1.
+    int     edges[3][BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE];
+} mc_grid_t;
 
-static int mc_compute(const int neighboors[8],
-                      mc_vert_t (*out)[3])
+// Compute the density and gradient of the grid corners [1, N - 1].
+static void mc_compute_grid(const block_data_t *data, int effects,
+                            mc_grid_t *grid)
 {
-    int edges, i, nb_tri;
-    int f0, f1;
-    int cube_index = 0;
-    mc_vert_t verts[12];
-
-    for (i = 0; i < 8; i++) if (neighboors[i] >= 127) cube_index |= 1 << i;
-    edges = MC_EDGE_TABLE[cube_index];
-    if (!edges) return 0;
-    for (i = 0; i < 12; i++) {
-        if (!(edges & (1 << i))) continue;
-        verts[i].v0 = EDGES_VERTICES[i][0];
-        verts[i].v1 = EDGES_VERTICES[i][1];
-        f0 = neighboors[verts[i].v0];
-        f1 = neighboors[verts[i].v1];
-        verts[i].mu = (f0 - 127) / (float)(f0 - f1);
-    }
-    nb_tri = 0;
-    for (i = 0; MC_TRI_TABLE[cube_index][i] != -1; i += 3) {
-        out[nb_tri][0] = verts[MC_TRI_TABLE[cube_index][i + 0]];
-        out[nb_tri][1] = verts[MC_TRI_TABLE[cube_index][i + 1]];
-        out[nb_tri][2] = verts[MC_TRI_TABLE[cube_index][i + 2]];
-        nb_tri++;
+    int x, y, z, w, a, i, sum, g[3];
+    const int k = (effects & EFFECT_FLAT) ? 2 : 8;
+
+    for (z = 1; z < N; z++)
+    for (y = 1; y < N; y++)
+    for (x = 1; x < N; x++) {
+        sum = 0;
+        g[0] = g[1] = g[2] = 0;
+        for (w = 0; w < 8; w++) {
+            a = DATA_AT(data, x + VERTICES_POSITIONS[w].x - 1,
+                              y + VERTICES_POSITIONS[w].y - 1,
+                              z + VERTICES_POSITIONS[w].z - 1).a;
+            sum += a;
+            for (i = 0; i < 3; i++)
+                g[i] -= a * (2 * VERTICES_POSITIONS[w].v[i] - 1);
+        }
+        i = GRID_IDX(x, y, z);
+        grid->density[i] = sum / k;
+        grid->gradient[i][0] = g[0];
+        grid->gradient[i][1] = g[1];
+        grid->gradient[i][2] = g[2];
     }
-    assert(nb_tri <= 5);
-    return nb_tri;
 }
 
-static vec3b_t mc_interp_pos(const mc_vert_t *vert)
+// Color of the most opaque voxel touching an edge.  If all of them are
+// empty, use the other voxels around the edge corners.
+static uvec4b_t mc_edge_color(const block_data_t *data, const int p[3],
+                              int axis)
 {
-    int i;
-    vec3b_t ret = vec3b_zero;
-    vec3b_t p0 = VERTICES_POSITIONS[vert->v0];
-    vec3b_t p1 = VERTICES_POSITIONS[vert->v1];
-    const float mu = vert->mu;
-    for (i = 0; i < 3; i++)
-        ret.v[i] = (p0.v[i] * (1 - mu) + p1.v[i] * mu) * MC_VOXEL_SUB_POS;
+    int i, j, k, v[3];
+    uvec4b_t c, ret = uvec4b(0, 0, 0, 0);
+    const int b = (axis + 1) % 3, d = (axis + 2) % 3;
+
+    for (i = 0; i < 3 && ret.a == 0; i++) {
+        // First the voxel along the edge, then the ones before and after.
+        v[axis] = p[axis] + ((int[]){0, -1, 1})[i];
+        for (j = -1; j <= 0; j++)
+        for (k = -1; k <= 0; k++) {
+            v[b] = p[b] + j;
+            v[d] = p[d] + k;
+            c = DATA_AT(data, v[0], v[1], v[2]);
+            if (c.a > ret.a) ret = c;
+        }
+    }
+    ret.a = 255;
     return ret;
 }
 
-static vec3_t mc_interp_normal(const mc_vert_t *vert, int normals[8][3])
+// Create the vertex on the edge starting at grid point p along an axis.
+static void mc_edge_vertex(const block_data_t *data, int effects,
+                           const mc_grid_t *grid, const int p[3], int axis,
+                           voxel_vertex_t *out)
 {
-    int i;
-    vec3_t ret = vec3_zero;
-    const int *p0 = normals[vert->v0];
-    const int *p1 = normals[vert->v1];
-    const float mu = vert->mu;
-    for (i = 0; i < 3; i++)
-        ret.v[i] = (p0[i] * (1 - mu) + p1[i] * mu);
-    vec3_normalize(&ret);
-    return ret;
+    int i, i0, i1;
+    float f0, f1, mu;
+    vec3_t n;
+
+    i0 = GRID_IDX(p[0], p[1], p[2]);
+    i1 = i0 + ((int[]){1, N, N * N})[axis];
+    f0 = grid->density[i0];
+    f1 = grid->density[i1];
+    mu = (f0 - 127) / (f0 - f1);
+
+    memset(out, 0, sizeof(*out));
+    for (i = 0; i < 3; i++) {
+        out->pos.v[i] = (p[i] + (i == axis ? mu : 0)) * MC_VOXEL_SUB_POS;
+        n.v[i] = grid->gradient[i0][i] * (1 - mu) +
+                 grid->gradient[i1][i] * mu;
+    }
+    if (!(effects & EFFECT_FLAT)) {
+        vec3_normalize(&n);
+        out->normal = vec3b(n.x * 126, n.y * 126, n.z * 126);
+    }
+    out->color = mc_edge_color(data, p, axis);
 }
 
 int block_generate_vertices_mc(const block_data_t *data, int effects,
-                               voxel_vertex_t *out)
+                               voxel_vertex_t *out, uint16_t *indices,
+                               int *nb_indices)
 {
-    int i, vi, x, y, z, v, w, vx, vy, vz, wx, wy, wz, nb_tri, nb_tri_tot = 0;
-    int a, sum_a;
+    mc_grid_t *grid;
+    int x, y, z, i, e, v, axis, c, idx, cube_index, nb = 0, nb_vertices = 0;
+    int p[3], local[12];
+    int *cache;
     vec3_t n;
-    uvec4b_t color;
-    int colorbest;
-    bool use_max_color;
-
-    int densities[8];
-    int normals[8][3];
-    int d, k = 2;
+    const bool flat = effects & EFFECT_FLAT;
 
-    mc_vert_t tri[5][3];
-    if (!(effects & EFFECT_FLAT)) k = 8;
+    *nb_indices = 0;
+    grid = malloc(sizeof(*grid));
+    mc_compute_grid(data, effects, grid);
+    if (!flat) memset(grid->edges, 0xff, sizeof(grid->edges));
 
-    // Add up the contribution of each voxel to the vertices values.
     BLOCK_ITER_INSIDE(x, y, z) {
-        memset(densities, 0, sizeof(densities));
-        memset(normals, 0, sizeof(normals));
-        n = vec3_zero;
-        color = DATA_AT(data, x, y, z);
-        use_max_color = (color.a == 0);
-        colorbest = 8;
-        sum_a = 0;
+        cube_index = 0;
         for (v = 0; v < 8; v++) {
+            idx = GRID_IDX(x + VERTICES_POSITIONS[v].x,
+                           y + VERTICES_POSITIONS[v].y,
+                           z + VERTICES_POSITIONS[v].z);
+            if (grid->density[idx] >= 127) cube_index |= 1 << v;
+        }
+        if (!MC_EDGE_TABLE[cube_index]) continue;
 
-            vx = x + VERTICES_POSITIONS[v].x;
-            vy = y + VERTICES_POSITIONS[v].y;
-            vz = z + VERTICES_POSITIONS[v].z;
-
-            for (w = 0; w < 8; w++) {
-                wx = vx + VERTICES_POSITIONS[w].x - 1;
-                wy = vy + VERTICES_POSITIONS[w].y - 1;
-                wz = vz + VERTICES_POSITIONS[w].z - 1;
-                a = DATA_AT(data, wx, wy, wz).a;
-
-                if (use_max_color && a) {
-                    d = abs(x - wx) + abs(y - wy) + abs(z - wz);
-                    if (d < colorbest) {
-                        color = DATA_AT(data, wx, wy, wz);
-                        colorbest = d;
-                    }
-                }
-
-                sum_a += a;
-                densities[v] += a;
-
-                if (!(effects & EFFECT_FLAT)) {
-                    normals[v][0] -= a * (2 * VERTICES_POSITIONS[w].x - 1);
-                    normals[v][1] -= a * (2 * VERTICES_POSITIONS[w].y - 1);
-                    normals[v][2] -= a * (2 * VERTICES_POSITIONS[w].z - 1);
+        for (e = 0; e < 12; e++) local[e] = -1;
+        for (i = 0; MC_TRI_TABLE[cube_index][i] != -1; i++) {
+            e = MC_TRI_TABLE[cube_index][i];
+            if (local[e] == -1) {
+                // The edge start is the corner with the lowest position.
+                axis = 0;
+                for (c = 0; c < 3; c++) {
+                    p[c] = (c == 0 ? x : c == 1 ? y : z) +
+                           min(VERTICES_POSITIONS[EDGES_VERTICES[e][0]].v[c],
+                               VERTICES_POSITIONS[EDGES_VERTICES[e][1]].v[c]);
+                    if (VERTICES_POSITIONS[EDGES_VERTICES[e][0]].v[c] !=
+                        VERTICES_POSITIONS[EDGES_VERTICES[e][1]].v[c])
+                        axis = c;
                 }
-                else {
-                    n.x -= a * (2 * VERTICES_POSITIONS[w].x - 1);
-                    n.y -= a * (2 * VERTICES_POSITIONS[w].y - 1);
-                    n.z -= a * (2 * VERTICES_POSITIONS[w].z - 1);
+                cache = flat ? &local[e] :
+                        &grid->edges[axis][GRID_IDX(p[0], p[1], p[2])];
+                if (*cache == -1) {
+                    mc_edge_vertex(data, effects, grid, p, axis,
+                                   &out[nb_vertices]);
+                    *cache = nb_vertices++;
                 }
+                local[e] = *cache;
+            }
+            indices[(*nb_indices)++] = local[e];
+        }
+
+        if (flat) {
+            // Same normal for all the vertices of the cell.
+            n = vec3_zero;
+            for (v = 0; v < 8; v++) {
+                idx = GRID_IDX(x + VERTICES_POSITIONS[v].x,
+                               y + VERTICES_POSITIONS[v].y,
+                               z + VERTICES_POSITIONS[v].z);
+                for (c = 0; c < 3; c++) n.v[c] += grid->gradient[idx][c];
             }
-            densities[v] /= k;
+            vec3_normalize(&n);
+            for (i = nb; i < nb_vertices; i++)
+                out[i].normal = vec3b(n.x * 126, n.y * 126, n.z * 126);
+            nb = nb_vertices;
         }
-        if (sum_a == 0) continue;
-        nb_tri = mc_compute(densities, tri);
-        if (effects & EFFECT_FLAT) vec3_normalize(&n);
-
-        for (i = 0; i < nb_tri; i++) {
-            for (v = 0; v < 3; v++) {
-                vi = (nb_tri_tot + i) * 3 + v;
-                out[vi].color = color;
-                out[vi].color.a = 255;
-                out[vi].pos = mc_interp_pos(&tri[i][v]);
-                if (!(effects & EFFECT_FLAT))
-                    n = mc_interp_normal(&tri[i][v], normals);
-                out[vi].normal = vec3b(n.x * 126, n.y * 126, n.z * 126);
-                vec3b_iaddk(&out[vi].pos, vec3b(x, y, z), MC_VOXEL_SUB_POS);
-                // XXX: this shouldn't matter.
-                out[vi].bshadow_uv = uvec2b(0, 0);
-                out[vi].bump_uv = uvec2b(0, 0);
+    }
+    free(grid);
+    return nb_vertices;
+}
+
+/*
+ * Surface nets: instead of up to 5 triangles per cell, we put a single
+ * vertex in each cell crossed by the surface, at the average of the
+ * crossing points of its edges, and for each crossed edge we add a quad
+ * joining the vertices of the four cells around it.
+ *
+ * Here the cells corners are the voxels centers, with the voxels alpha as
+ * density.  This way the four cells around an edge starting from any
+ * interior voxel are inside the block, so each block can output the quads
+ * of its own edges without looking at its neighbors.
+ */
+
+// Create the vertex of a cell, the cell corners being the voxels
+// c + VERTICES_POSITIONS.
+static void sn_cell_vertex(const block_data_t *data, const int c[3],
+                           voxel_vertex_t *out)
+{
+    int i, e, v, nb = 0;
+    float a[8], mu;
+    vec3_t pos = vec3_zero, n = vec3_zero;
+    uvec4b_t color = uvec4b(0, 0, 0, 0), vc;
+    const vec3b_t *p0, *p1;
+
+    for (v = 0; v < 8; v++) {
+        vc = DATA_AT(data, c[0] + VERTICES_POSITIONS[v].x,
+                           c[1] + VERTICES_POSITIONS[v].y,
+                           c[2] + VERTICES_POSITIONS[v].z);
+        a[v] = vc.a;
+        if (vc.a > color.a) color = vc;
+        for (i = 0; i < 3; i++)
+            n.v[i] -= vc.a * (2 * VERTICES_POSITIONS[v].v[i] - 1);
+    }
+    for (e = 0; e < 12; e++) {
+        if ((a[EDGES_VERTICES[e][0]] >= 127) ==
+            (a[EDGES_VERTICES[e][1]] >= 127)) continue;
+        p0 = &VERTICES_POSITIONS[EDGES_VERTICES[e][0]];
+        p1 = &VERTICES_POSITIONS[EDGES_VERTICES[e][1]];
+        mu = (a[EDGES_VERTICES[e][0]] - 127) /
+             (a[EDGES_VERTICES[e][0]] - a[EDGES_VERTICES[e][1]]);
+        for (i = 0; i < 3; i++)
+            pos.v[i] += p0->v[i] * (1 - mu) + p1->v[i] * mu;
+        nb++;
+    }
+    memset(out, 0, sizeof(*out));
+    for (i = 0; i < 3; i++)
+        out->pos.v[i] = (c[i] + 0.5 + pos.v[i] / nb) * MC_VOXEL_SUB_POS;
+    vec3_normalize(&n);
+    out->normal = vec3b(n.x * 126, n.y * 126, n.z * 126);
+    out->color = color;
+    out->color.a = 255;
+}
+
+int block_generate_vertices_sn(const block_data_t *data, int effects,
+                               voxel_vertex_t *out, uint16_t *indices,
+                               int *nb_indices)
+{
+    const int QUAD_TRIS[6] = {0, 1, 2, 2, 3, 0};
+    int x, y, z, axis, b, d, i, j, nb_vertices = 0;
+    int v[3], c[3], quad[4];
+    bool solid;
+    int *cells; // Index of the vertex of each cell, or -1.
+
+    *nb_indices = 0;
+    cells = malloc(N * N * N * sizeof(*cells));
+    memset(cells, 0xff, N * N * N * sizeof(*cells));
+
+    BLOCK_ITER_INSIDE(x, y, z) {
+        solid = DATA_AT(data, x, y, z).a >= 127;
+        for (axis = 0; axis < 3; axis++) {
+            if ((DATA_AT(data, x + (axis == 0),
+                               y + (axis == 1),
+                               z + (axis == 2)).a >= 127) == solid)
+                continue;
+            v[0] = x;
+            v[1] = y;
+            v[2] = z;
+            b = (axis + 1) % 3;
+            d = (axis + 2) % 3;
+            // The four cells around the edge, counter clockwise around
+            // the axis.
+            for (i = 0; i < 4; i++) {
+                c[axis] = v[axis];
+                c[b] = v[b] - 1 + (i == 1 || i == 2);
+                c[d] = v[d] - 1 + (i >= 2);
+                j = GRID_IDX(c[0], c[1], c[2]);
+                if (cells[j] == -1) {
+                    sn_cell_vertex(data, c, &out[nb_vertices]);
+                    cells[j] = nb_vertices++;
+                }
+                quad[i] = cells[j];
             }
+            // Make the quad face toward the empty voxel.
+            if (!solid) SWAP(quad[1], quad[3]);
+            for (i = 0; i < 6; i++)
+                indices[(*nb_indices)++] = quad[QUAD_TRIS[i]];
         }
-        nb_tri_tot += nb_tri;
     }
-    return nb_tri_tot;
+    free(cells);
+    return nb_vertices;
 }
 
 // Static data for marching cube algo.
@@ -474,3 +599,38 @@ static const int8_t MC_TRI_TABLE[256][16] = {
     {0, 3, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}
 };
+
+// Compare the marching cubes and surface nets meshers on the current image.
+static void bench_smooth_meshers(void)
+{
+    const char *names[2] = {"marching cubes", "surface nets"};
+    block_t *block;
+    voxel_vertex_t *verts;
+    uint16_t *indices;
+    int i, nb_indices, nb_vertices, nb_tris;
+    int64_t t;
+
+    verts = calloc(BLOCK_MC_MAX_VERTICES, sizeof(*verts));
+    indices = calloc(BLOCK_MC_MAX_INDICES, sizeof(*indices));
+    for (i = 0; i < 2; i++) {
+        nb_vertices = 0;
+        nb_tris = 0;
+        t = get_clock();
+        MESH_ITER_BLOCKS(goxel->layers_mesh, block) {
+            nb_vertices += (i == 0 ? block_generate_vertices_mc :
+                                     block_generate_vertices_sn)(
+                    block->data, 0, verts, indices, &nb_indices);
+            nb_tris += nb_indices / 3;
+        }
+        LOG_I("%s: %d vertices, %d triangles, %.2f ms", names[i],
+              nb_vertices, nb_tris, (get_clock() - t) / 1e6);
+    }
+    free(verts);
+    free(indices);
+}
+
+ACTION_REGISTER(bench_smooth_meshers,
+    .help = "Log the vertices count and time of the smooth meshers",
+    .cfunc = bench_smooth_meshers,
+    .csig = "v",
+)
@@ -17,6 +17,7 @@
  */
 
 #include "goxel.h"
+#include <limits.h>
 
 // Keep track of the last operation, so that it is fast to do it again.
 typedef struct {
@@ -30,21 +31,30 @@ static operation_t g_last_op= {};
 
 static void mesh_prepare_write(mesh_t *mesh)
 {
-    block_t *blocks, *block, *new_block;
-    assert(*mesh->ref > 0);
-    mesh->id = goxel->next_uid++;
-    if (*mesh->ref == 1)
+    block_t *blocks, *block, *tmp, *new_block;
+    int *ref;
+    mesh->id = __sync_fetch_and_add(&goxel->next_uid, 1);
+    if (__atomic_load_n(mesh->ref, __ATOMIC_ACQUIRE) == 1)
         return;
-    (*mesh->ref)--;
-    mesh->ref = calloc(1, sizeof(*mesh->ref));
-    *mesh->ref = 1;
+    // Copy the blocks before we release our reference, since once the
+    // count gets down to one, the other owner can modify them in place.
     blocks = mesh->blocks;
+    ref = mesh->ref;
     mesh->blocks = NULL;
     for (block = blocks; block; block = block->hh.next) {
         new_block = block_copy(block);
-        new_block->id = block->id;
         HASH_ADD(hh, mesh->blocks, pos, sizeof(new_block->pos), new_block);
     }
+    mesh->ref = calloc(1, sizeof(*mesh->ref));
+    *mesh->ref = 1;
+    // The other owners might have released the blocks in the meantime.
+    if (__sync_sub_and_fetch(ref, 1) == 0) {
+        HASH_ITER(hh, blocks, block, tmp) {
+            HASH_DEL(blocks, block);
+            block_delete(block);
+        }
+        free(ref);
+    }
 }
 
 void mesh_remove_empty_blocks(mesh_t *mesh)
@@ -63,9 +73,8 @@ mesh_t *mesh_new(void)
 {
     mesh_t *mesh;
     mesh = calloc(1, sizeof(*mesh));
-    mesh->next_block_id = 1;
     mesh->ref = calloc(1, sizeof(*mesh->ref));
-    mesh->id = goxel->next_uid++;
+    mesh->id = __sync_fetch_and_add(&goxel->next_uid, 1);
     *mesh->ref = 1;
     return mesh;
 }
@@ -80,15 +89,13 @@ void mesh_clear(mesh_t *mesh)
         block_delete(block);
     }
     mesh->blocks = NULL;
-    mesh->next_block_id = 1;
 }
 
 void mesh_delete(mesh_t *mesh)
 {
     block_t *block, *tmp;
     if (!mesh) return;
-    (*mesh->ref)--;
-    if (*mesh->ref == 0) {
+    if (__sync_sub_and_fetch(mesh->ref, 1) == 0) {
         HASH_ITER(hh, mesh->blocks, block, tmp) {
             HASH_DEL(mesh->blocks, block);
             block_delete(block);
@@ -104,8 +111,7 @@ mesh_t *mesh_copy(const mesh_t *other)
     mesh->blocks = other->blocks;
     mesh->ref = other->ref;
     mesh->id = other->id;
-    mesh->next_block_id = other->next_block_id;
-    (*mesh->ref)++;
+    __sync_add_and_fetch(mesh->ref, 1);
     return mesh;
 }
 
@@ -114,8 +120,7 @@ void mesh_set(mesh_t *mesh, const mesh_t *other)
     block_t *block, *tmp;
     assert(mesh && other);
     if (mesh->blocks == other->blocks) return; // Already the same.
-    (*mesh->ref)--;
-    if (*mesh->ref == 0) {
+    if (__sync_sub_and_fetch(mesh->ref, 1) == 0) {
         HASH_ITER(hh, mesh->blocks, block, tmp) {
             HASH_DEL(mesh->blocks, block);
             block_delete(block);
@@ -124,8 +129,7 @@ void mesh_set(mesh_t *mesh, const mesh_t *other)
     }
     mesh->blocks = other->blocks;
     mesh->ref = other->ref;
-    mesh->next_block_id = other->next_block_id;
-    (*mesh->ref)++;
+    __sync_add_and_fetch(mesh->ref, 1);
 }
 
 static void add_blocks(mesh_t *mesh, box_t box);
@@ -163,36 +167,108 @@ static block_t *mesh_get_block_at(const mesh_t *mesh, const vec3i_t *pos)
     return block;
 }
 
-// Add blocks if needed to fill the box.
-static void add_blocks(mesh_t *mesh, box_t box)
+// Range of the positions of the blocks needed to fill a box.
+static void get_blocks_range(const box_t *box, int lo[3], int hi[3])
 {
     vec3_t a, b;
-    float x, y, z;
     int i;
     const int s = BLOCK_SIZE - 2;
-    vec3i_t p;
 
-    a = vec3(box.p.x - box.w.x, box.p.y - box.h.y, box.p.z - box.d.z);
-    b = vec3(box.p.x + box.w.x, box.p.y + box.h.y, box.p.z + box.d.z);
+    a = vec3(box->p.x - box->w.x, box->p.y - box->h.y, box->p.z - box->d.z);
+    b = vec3(box->p.x + box->w.x, box->p.y + box->h.y, box->p.z + box->d.z);
     for (i = 0; i < 3; i++) {
-        a.v[i] = round(a.v[i] / s) * s;
-        b.v[i] = round(b.v[i] / s) * s;
+        lo[i] = round(a.v[i] / s) * s;
+        hi[i] = round(b.v[i] / s) * s;
     }
-    for (z = a.z; z <= b.z; z += s)
-    for (y = a.y; y <= b.y; y += s)
-    for (x = a.x; x <= b.x; x += s)
+}
+
+// Add blocks if needed to fill the box.
+static void add_blocks(mesh_t *mesh, box_t box)
+{
+    int lo[3], hi[3];
+    const int s = BLOCK_SIZE - 2;
+    vec3i_t p;
+
+    get_blocks_range(&box, lo, hi);
+    for (p.z = lo[2]; p.z <= hi[2]; p.z += s)
+    for (p.y = lo[1]; p.y <= hi[1]; p.y += s)
+    for (p.x = lo[0]; p.x <= hi[0]; p.x += s)
     {
-        p = vec3i(x, y, z);
-        assert(p.x % s == 0);
-        assert(p.y % s == 0);
-        assert(p.z % s == 0);
         if (!mesh_get_block_at(mesh, &p))
             mesh_add_block(mesh, NULL, &p);
     }
 }
 
+// Compute the boxes used by an operation:
+//  full_box: the box grown to take the smoothness into account.
+//  bbox:     the bounding box of all the voxels that can be affected.
+static void get_op_boxes(const painter_t *painter, const box_t *box,
+                         box_t *full_box, box_t *bbox)
+{
+    box_t clip;
+    *full_box = *box;
+    mat4_igrow(&full_box->mat, painter->smoothness,
+                               painter->smoothness,
+                               painter->smoothness);
+    *bbox = bbox_grow(box_get_bbox(*full_box), 1, 1, 1);
+    if (painter->box) {
+        clip = box_get_bbox(*painter->box);
+        if (bbox_intersect(*bbox, clip))
+            *bbox = bbox_intersection(*bbox, clip);
+    }
+}
+
+// Apply an operation to a single block of a mesh, and remove the block from
+// the mesh if it ends up empty.
+static void op_block(mesh_t *mesh, block_t *block, painter_t *painter,
+                     const box_t *box, const box_t *full_box,
+                     const box_t *bbox)
+{
+    box_t block_box;
+    bool empty = false;
+
+    block_box = block_get_box(block, false);
+    if (!bbox_intersect(*bbox, block_box) && painter->mode != MODE_INTERSECT)
+        return;
+    // Optimization for the case when we delete large blocks.
+    // XXX: this is too specific.  we need a way to tell if a given
+    // shape totally contains a box.
+    if (    painter->shape == &shape_cube && painter->mode == MODE_SUB &&
+            box_contains(*full_box, block_box) &&
+            (!painter->box ||
+             bbox_contains(box_get_bbox(*painter->box), block_box)))
+        empty = true;
+    if (!empty) {
+        block_op(block, painter, box);
+        if (block_is_empty(block, true)) empty = true;
+    }
+    if (empty) {
+        HASH_DEL(mesh->blocks, block);
+        block_delete(block);
+    }
+}
+
+// The operation itself, without the last operation buffer.
+static void mesh_op_(mesh_t *mesh, painter_t *painter, const box_t *box)
+{
+    block_t *block, *tmp;
+    box_t full_box, bbox;
+
+    get_op_boxes(painter, box, &full_box, &bbox);
+
+    // For constructive modes, we have to add blocks if they are not present.
+    mesh_prepare_write(mesh);
+    if (IS_IN(painter->mode, MODE_OVER, MODE_MAX)) {
+        add_blocks(mesh, bbox);
+    }
+    HASH_ITER(hh, mesh->blocks, block, tmp) {
+        op_block(mesh, block, painter, box, &full_box, &bbox);
+    }
+}
+
 void mesh_op(mesh_t *mesh, painter_t *painter, const box_t *box)
 {
+    PROFILED;
     // In case we are doing the same operation as last time, we can just use
     // the value we buffered.
     if (!g_last_op.origin) g_last_op.origin = mesh_new();
@@ -208,51 +284,171 @@ void mesh_op(mesh_t *mesh, painter_t *painter, const box_t *box)
     mesh_set(g_last_op.origin, mesh);
     g_last_op.painter   = *painter;
     g_last_op.box       = *box;
+    mesh_op_(mesh, painter, box);
+    mesh_set(g_last_op.result, mesh);
+}
 
-    block_t *block, *tmp;
-    box_t full_box, bbox, block_box;
-    bool empty;
+/*
+ * Batched operations.
+ *
+ * mesh_op walks all the blocks of the mesh, and copies the mesh blocks list
+ * since it is shared with the last op buffer, so it gets slow when we do a
+ * lot of small operations, like the procedural programs.  Instead we bin the
+ * queued operations by the positions of the blocks they can affect, and then
+ * run the operations of each block in order.  An operation on a block only
+ * depends on the block itself, so we get the same result as with mesh_op.
+ */
 
-    // Grow the box to take the smoothness into account.
-    full_box = *box;
-    mat4_igrow(&full_box.mat, painter->smoothness,
-                              painter->smoothness,
-                              painter->smoothness);
-    bbox = bbox_grow(box_get_bbox(full_box), 1, 1, 1);
+// Max number of queued operations before we apply them.
+#define BATCH_MAX_OPS 4096
 
-    // For constructive modes, we have to add blocks if they are not present.
-    mesh_prepare_write(mesh);
-    if (IS_IN(painter->mode, MODE_OVER, MODE_MAX)) {
-        add_blocks(mesh, bbox);
+typedef struct {
+    painter_t   painter;
+    box_t       box;
+    box_t       full_box;
+    box_t       bbox;
+    bool        add;        // Set for the constructive modes.
+    int         add_lo[3];  // Range of the blocks added for this op.
+    int         add_hi[3];
+} batch_op_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    vec3i_t         pos;
+    int             nb;
+    int             size;
+    int             *ops;   // Indices of the ops affecting the block.
+} batch_bin_t;
+
+struct mesh_op_batch {
+    mesh_t      *mesh;
+    int         nb;
+    int         size;
+    batch_op_t  *ops;
+    batch_bin_t *bins;
+};
+
+mesh_op_batch_t *mesh_op_batch_new(void)
+{
+    return calloc(1, sizeof(mesh_op_batch_t));
+}
+
+void mesh_op_batch_delete(mesh_op_batch_t *batch)
+{
+    if (!batch) return;
+    mesh_op_batch_apply(batch);
+    free(batch->ops);
+    free(batch);
+}
+
+static void batch_bin_add(mesh_op_batch_t *batch, const vec3i_t *pos, int op)
+{
+    batch_bin_t *bin;
+    HASH_FIND(hh, batch->bins, pos, sizeof(*pos), bin);
+    if (!bin) {
+        bin = calloc(1, sizeof(*bin));
+        bin->pos = *pos;
+        HASH_ADD(hh, batch->bins, pos, sizeof(bin->pos), bin);
     }
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        block_box = block_get_box(block, false);
-        if (!bbox_intersect(bbox, block_box)) {
-            if (painter->mode == MODE_INTERSECT) empty = true;
-            else continue;
-        }
-        empty = false;
-        // Optimization for the case when we delete large blocks.
-        // XXX: this is too specific.  we need a way to tell if a given
-        // shape totally contains a box.
-        if (    painter->shape == &shape_cube && painter->mode == MODE_SUB &&
-                box_contains(full_box, block_box))
-            empty = true;
-        if (!empty) {
-            block_op(block, painter, box);
-            if (block_is_empty(block, true)) empty = true;
-        }
-        if (empty) {
-            HASH_DEL(mesh->blocks, block);
-            block_delete(block);
+    if (bin->nb == bin->size) {
+        bin->size = max(bin->size * 2, 8);
+        bin->ops = realloc(bin->ops, bin->size * sizeof(*bin->ops));
+    }
+    bin->ops[bin->nb++] = op;
+}
+
+void mesh_op_batch_add(mesh_op_batch_t *batch, mesh_t *mesh,
+                       const painter_t *painter, const box_t *box)
+{
+    const int s = BLOCK_SIZE - 2;
+    batch_op_t *op;
+    int i, lo[3], hi[3];
+    float c, r;
+    vec3i_t p;
+
+    if (batch->mesh != mesh || batch->nb >= BATCH_MAX_OPS)
+        mesh_op_batch_apply(batch);
+    // This one affects all the blocks, so we first apply the pending ops.
+    // We don't use mesh_op since the batch can be used outside of the main
+    // thread.
+    if (painter->mode == MODE_INTERSECT) {
+        mesh_op_batch_apply(batch);
+        mesh_op_(mesh, (painter_t*)painter, box);
+        return;
+    }
+    batch->mesh = mesh;
+    if (batch->nb == batch->size) {
+        batch->size = max(batch->size * 2, 64);
+        batch->ops = realloc(batch->ops, batch->size * sizeof(*batch->ops));
+    }
+    op = &batch->ops[batch->nb];
+    op->painter = *painter;
+    op->box = *box;
+    get_op_boxes(painter, box, &op->full_box, &op->bbox);
+    op->add = IS_IN(painter->mode, MODE_OVER, MODE_MAX);
+    get_blocks_range(&op->bbox, op->add_lo, op->add_hi);
+
+    // All the blocks whose box can intersect the op bbox.
+    for (i = 0; i < 3; i++) {
+        c = op->bbox.p.v[i];
+        r = op->bbox.mat.v[i * 5] + BLOCK_SIZE / 2;
+        lo[i] = ceil((c - r) / s) * s;
+        hi[i] = floor((c + r) / s) * s;
+        if (op->add) {
+            lo[i] = min(lo[i], op->add_lo[i]);
+            hi[i] = max(hi[i], op->add_hi[i]);
         }
     }
+    for (p.z = lo[2]; p.z <= hi[2]; p.z += s)
+    for (p.y = lo[1]; p.y <= hi[1]; p.y += s)
+    for (p.x = lo[0]; p.x <= hi[0]; p.x += s)
+        batch_bin_add(batch, &p, batch->nb);
+    batch->nb++;
+}
 
-    mesh_set(g_last_op.result, mesh);
+static bool op_adds_block(const batch_op_t *op, const vec3i_t *pos)
+{
+    int i;
+    if (!op->add) return false;
+    for (i = 0; i < 3; i++) {
+        if (pos->v[i] < op->add_lo[i] || pos->v[i] > op->add_hi[i])
+            return false;
+    }
+    return true;
+}
+
+void mesh_op_batch_apply(mesh_op_batch_t *batch)
+{
+    PROFILED;
+    batch_bin_t *bin, *tmp;
+    batch_op_t *op;
+    block_t *block;
+    mesh_t *mesh = batch->mesh;
+    int i;
+
+    if (batch->nb) mesh_prepare_write(mesh);
+    HASH_ITER(hh, batch->bins, bin, tmp) {
+        block = mesh_get_block_at(mesh, &bin->pos);
+        for (i = 0; i < bin->nb; i++) {
+            op = &batch->ops[bin->ops[i]];
+            if (!block && op_adds_block(op, &bin->pos))
+                block = mesh_add_block(mesh, NULL, &bin->pos);
+            if (!block) continue;
+            op_block(mesh, block, &op->painter, &op->box, &op->full_box,
+                     &op->bbox);
+            block = mesh_get_block_at(mesh, &bin->pos);
+        }
+        HASH_DEL(batch->bins, bin);
+        free(bin->ops);
+        free(bin);
+    }
+    batch->nb = 0;
+    batch->mesh = NULL;
 }
 
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode)
 {
+    PROFILED;
     assert(mesh && other);
     block_t *block, *other_block, *tmp;
     mesh_prepare_write(mesh);
@@ -278,6 +474,76 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode)
     }
 }
 
+// Range of the positions of the blocks that contain the interior voxels
+// of a block at p, including the ones where they are only in the borders.
+static void get_stamp_range(const vec3i_t *p, int lo[3], int hi[3])
+{
+    const int s = BLOCK_SIZE - 2;
+    int i;
+    for (i = 0; i < 3; i++) {
+        lo[i] = (int)ceil((float)p->v[i] / s) * s - s;
+        hi[i] = (int)floor((float)p->v[i] / s) * s + s;
+    }
+}
+
+bool mesh_stamp(mesh_t *mesh, const mesh_t *other, const vec3i_t *offset)
+{
+    PROFILED;
+    const int s = BLOCK_SIZE - 2;
+    block_t *src, *block, *same;
+    vec3i_t p, q, r;
+    int lo[3], hi[3];
+    bool aligned;
+
+    aligned = offset->x % s == 0 && offset->y % s == 0 && offset->z % s == 0;
+    MESH_ITER_BLOCKS(other, src) {
+        p = vec3i(src->pos.x + offset->x, src->pos.y + offset->y,
+                  src->pos.z + offset->z);
+        get_stamp_range(&p, lo, hi);
+        for (q.z = lo[2]; q.z <= hi[2]; q.z += s)
+        for (q.y = lo[1]; q.y <= hi[1]; q.y += s)
+        for (q.x = lo[0]; q.x <= hi[0]; q.x += s) {
+            block = mesh_get_block_at(mesh, &q);
+            if (block && !block_can_stamp(block, src->data, &p))
+                return false;
+        }
+    }
+
+    mesh_prepare_write(mesh);
+    // The new aligned blocks directly share the other mesh data.
+    if (aligned) {
+        MESH_ITER_BLOCKS(other, src) {
+            p = vec3i(src->pos.x + offset->x, src->pos.y + offset->y,
+                      src->pos.z + offset->z);
+            if (!mesh_get_block_at(mesh, &p))
+                mesh_add_block(mesh, src->data, &p);
+        }
+    }
+    MESH_ITER_BLOCKS(other, src) {
+        p = vec3i(src->pos.x + offset->x, src->pos.y + offset->y,
+                  src->pos.z + offset->z);
+        get_stamp_range(&p, lo, hi);
+        for (q.z = lo[2]; q.z <= hi[2]; q.z += s)
+        for (q.y = lo[1]; q.y <= hi[1]; q.y += s)
+        for (q.x = lo[0]; q.x <= hi[0]; q.x += s) {
+            block = mesh_get_block_at(mesh, &q);
+            if (block && aligned) {
+                r = vec3i(q.x - offset->x, q.y - offset->y, q.z - offset->z);
+                same = mesh_get_block_at(other, &r);
+                if (same && same->data == block->data) continue;
+            }
+            // Like mesh_op, the new blocks start empty, borders included.
+            if (!block) block = mesh_add_block(mesh, NULL, &q);
+            block_stamp(block, src->data, &p);
+            if (block_is_empty(block, true)) {
+                HASH_DEL(mesh->blocks, block);
+                block_delete(block);
+            }
+        }
+    }
+    return true;
+}
+
 block_t *mesh_add_block(mesh_t *mesh, block_data_t *data, const vec3i_t *pos)
 {
     block_t *block;
@@ -287,7 +553,6 @@ block_t *mesh_add_block(mesh_t *mesh, block_data_t *data, const vec3i_t *pos)
     assert(!mesh_get_block_at(mesh, pos));
     mesh_prepare_write(mesh);
     block = block_new(pos, data);
-    block->id = mesh->next_block_id++;
     HASH_ADD(hh, mesh->blocks, pos, sizeof(block->pos), block);
     return block;
 }
@@ -374,3 +639,159 @@ void mesh_shift_alpha(mesh_t *mesh, int v)
     }
     mesh_remove_empty_blocks(mesh);
 }
+
+// Set the voxel position and the DDA values of a ray at a given distance.
+// If 'axis' is not -1, the ray is entering a new voxel along this axis,
+// and we use the exact voxel position on this axis to avoid rounding
+// errors.
+static void raycast_set_pos(const vec3_t *o, const vec3_t *d, float t,
+                            int axis, int entry, const int lo[3],
+                            const int hi[3], const int step[3],
+                            int v[3], float tmax[3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (i == axis) v[i] = entry;
+        else v[i] = clamp((int)floor(o->v[i] + d->v[i] * t), lo[i], hi[i]);
+        tmax[i] = step[i] ? (v[i] + (step[i] > 0) - o->v[i]) / d->v[i] :
+                            INFINITY;
+    }
+}
+
+/*
+ * Two levels DDA: we walk the blocks along the ray, skipping the missing
+ * or empty ones, and then the voxels of the 14^3 interior of each block.
+ * Voxels with an alpha lower than 127 are considered transparent, like in
+ * block_generate_vertices.
+ */
+bool mesh_raycast_bounded(const mesh_t *mesh, const int lo[3],
+                          const int hi[3], const vec3_t *o, const vec3_t *d,
+                          float max_dist, vec3_t *out_pos,
+                          vec3_t *out_normal, uvec4b_t *out_color,
+                          float *out_dist)
+{
+    const int N = BLOCK_SIZE - 2;
+    block_t *block;
+    vec3i_t bpos;
+    int i, a, axis = -1, entry = 0;
+    int v[3], step[3], blo[3], bhi[3];
+    float t0 = 0, t1 = max_dist, ta, tb, t, tdelta[3], tmax[3];
+    uvec4b_t c;
+
+    if (!mesh->blocks || lo[0] > hi[0]) return false;
+
+    // Clip the ray to the bounding box.
+    for (i = 0; i < 3; i++) {
+        step[i] = d->v[i] > 0 ? 1 : d->v[i] < 0 ? -1 : 0;
+        tdelta[i] = step[i] ? fabs(1 / d->v[i]) : INFINITY;
+        if (!step[i]) {
+            if (o->v[i] < lo[i] || o->v[i] >= hi[i] + 1) return false;
+            continue;
+        }
+        ta = (lo[i] - o->v[i]) / d->v[i];
+        tb = (hi[i] + 1 - o->v[i]) / d->v[i];
+        if (ta > tb) {
+            t = ta;
+            ta = tb;
+            tb = t;
+        }
+        if (ta > t0) {
+            t0 = ta;
+            axis = i;
+        }
+        t1 = min(t1, tb);
+    }
+    if (t0 > t1) return false;
+    if (axis != -1) entry = step[axis] > 0 ? lo[axis] : hi[axis];
+    t = t0;
+    raycast_set_pos(o, d, t, axis, entry, lo, hi, step, v, tmax);
+
+    while (true) {
+        for (i = 0; i < 3; i++) {
+            bpos.v[i] = (int)floor((v[i] + N / 2) / (float)N) * N;
+            blo[i] = bpos.v[i] - N / 2;
+            bhi[i] = bpos.v[i] + N / 2 - 1;
+        }
+        block = mesh_get_block_at(mesh, &bpos);
+
+        if (block_is_empty(block, true)) {
+            // Jump directly to the next block.
+            a = -1;
+            for (i = 0; i < 3; i++) {
+                if (!step[i]) continue;
+                ta = ((step[i] > 0 ? bhi[i] + 1 : blo[i]) - o->v[i]) /
+                     d->v[i];
+                if (a == -1 || ta < t) {
+                    a = i;
+                    t = ta;
+                }
+            }
+            if (t > t1) return false;
+            axis = a;
+            entry = step[a] > 0 ? bhi[a] + 1 : blo[a] - 1;
+            raycast_set_pos(o, d, t, axis, entry, blo, bhi, step, v, tmax);
+            continue;
+        }
+
+        while (v[0] >= blo[0] && v[0] <= bhi[0] &&
+               v[1] >= blo[1] && v[1] <= bhi[1] &&
+               v[2] >= blo[2] && v[2] <= bhi[2]) {
+            c = block->data->voxels[
+                    (v[0] - bpos.x + BLOCK_SIZE / 2) +
+                    (v[1] - bpos.y + BLOCK_SIZE / 2) * BLOCK_SIZE +
+                    (v[2] - bpos.z + BLOCK_SIZE / 2) * BLOCK_SIZE * BLOCK_SIZE];
+            if (c.a >= 127) goto hit;
+            a = tmax[0] < tmax[1] ? (tmax[0] < tmax[2] ? 0 : 2) :
+                                    (tmax[1] < tmax[2] ? 1 : 2);
+            t = tmax[a];
+            if (t > t1) return false;
+            v[a] += step[a];
+            tmax[a] += tdelta[a];
+            axis = a;
+        }
+    }
+
+hit:
+    // If the ray started inside a voxel, use the main direction of the ray
+    // for the normal.
+    if (axis == -1) {
+        axis = (fabs(d->x) > fabs(d->y)) ?
+                    (fabs(d->x) > fabs(d->z) ? 0 : 2) :
+                    (fabs(d->y) > fabs(d->z) ? 1 : 2);
+    }
+    if (out_pos) *out_pos = vec3(v[0] + 0.5, v[1] + 0.5, v[2] + 0.5);
+    if (out_normal) {
+        *out_normal = vec3_zero;
+        out_normal->v[axis] = -step[axis];
+    }
+    if (out_color) *out_color = c;
+    if (out_dist) *out_dist = t;
+    return true;
+}
+
+void mesh_get_blocks_bounds(const mesh_t *mesh, int lo[3], int hi[3])
+{
+    const int N = BLOCK_SIZE - 2;
+    block_t *block;
+    int i;
+    for (i = 0; i < 3; i++) {
+        lo[i] = INT_MAX;
+        hi[i] = INT_MIN;
+    }
+    MESH_ITER_BLOCKS(mesh, block) {
+        for (i = 0; i < 3; i++) {
+            lo[i] = min(lo[i], block->pos.v[i] - N / 2);
+            hi[i] = max(hi[i], block->pos.v[i] + N / 2 - 1);
+        }
+    }
+}
+
+bool mesh_raycast(const mesh_t *mesh, const vec3_t *o, const vec3_t *d,
+                  float max_dist, vec3_t *pos, vec3_t *normal,
+                  uvec4b_t *color, float *dist)
+{
+    int lo[3], hi[3];
+    mesh_get_blocks_bounds(mesh, lo, hi);
+    return mesh_raycast_bounded(mesh, lo, hi, o, d, max_dist,
+                                pos, normal, color, dist);
+}
@@ -0,0 +1,244 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2017 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+/*
+ * Simple CPU path tracer.
+ *
+ * We don't generate any triangles: all the rays are cast directly into the
+ * mesh blocks with mesh_raycast_bounded, so the memory usage only depends
+ * on the size of the image.
+ *
+ * The lighting tries to match the OpenGL renderer settings: the light
+ * gives the diffuse and specular terms, and the ambient term is a uniform
+ * white sky, so that a non occluded voxel gets the same color as with the
+ * GL renderer, but we also get ambient occlusion and color bleeding from
+ * the bounces.  The voxels are rendered as flat cubes (no smoothness,
+ * borders or marching cubes).
+ *
+ * Each call to pathtracer_iter adds one sample per pixel, so that we can
+ * save the image while it gets refined.  The tiles are rendered in
+ * parallel, and since the random numbers only depend on the pixel and
+ * sample index, the result doesn't depend on the threads scheduling.
+ */
+
+#define TILE_SIZE 32
+#define MAX_BOUNCES 3
+
+struct pathtracer {
+    const mesh_t *mesh;
+    render_settings_t settings;
+    float   intensity;
+    int     w, h;
+    int     samples;
+    mat4_t  inv_vp;     // Inverse of the view projection matrix.
+    vec3_t  light_dir;
+    int     bounds[2][3];
+    int     nb_tiles[2];
+    float   *acc;       // Accumulated premultiplied RGBA.
+};
+
+static uint32_t hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Xorshift random number in [0, 1).
+static float rnd(uint32_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return (*s >> 8) / 16777216.0f;
+}
+
+static bool cast(const pathtracer_t *pt, const vec3_t *o, const vec3_t *d,
+                 vec3_t *pos, vec3_t *normal, vec3_t *color)
+{
+    uvec4b_t c;
+    float dist;
+    if (!mesh_raycast_bounded(pt->mesh, pt->bounds[0], pt->bounds[1], o, d,
+                              INFINITY, NULL, normal, &c, &dist))
+        return false;
+    *pos = vec3_addk(*o, *d, dist);
+    *color = vec3(c.r / 255., c.g / 255., c.b / 255.);
+    return true;
+}
+
+// Cosine weighted random direction around a normal.
+static vec3_t sample_hemisphere(const vec3_t *n, uint32_t *s)
+{
+    float r1 = rnd(s), r2 = rnd(s), r, phi;
+    vec3_t t, b, ret;
+    t = fabs(n->x) > 0.5 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    b = vec3_normalized(vec3_cross(*n, t));
+    t = vec3_cross(b, *n);
+    r = sqrt(r1);
+    phi = 2 * M_PI * r2;
+    ret = vec3_mul(*n, sqrt(1 - r1));
+    vec3_iaddk(&ret, t, r * cos(phi));
+    vec3_iaddk(&ret, b, r * sin(phi));
+    return ret;
+}
+
+// Direct light from the directional light at a surface point.
+static vec3_t direct_light(const pathtracer_t *pt, const vec3_t *pos,
+                           const vec3_t *n, const vec3_t *view,
+                           const vec3_t *albedo, bool specular)
+{
+    const render_settings_t *settings = &pt->settings;
+    const vec3_t s = pt->light_dir;
+    float s_dot_n, l_spe = 0, visibility = 1;
+    vec3_t o, r, ret;
+
+    s_dot_n = vec3_dot(s, *n);
+    if (s_dot_n <= 0) return vec3_zero;
+    if (settings->shadow) {
+        o = vec3_addk(*pos, *n, 0.001);
+        if (mesh_raycast_bounded(pt->mesh, pt->bounds[0], pt->bounds[1],
+                                 &o, &s, INFINITY, NULL, NULL, NULL, NULL))
+            visibility = 1 - settings->shadow;
+    }
+    if (specular && settings->specular > 0) {
+        r = vec3_sub(vec3_mul(*n, 2 * s_dot_n), s);
+        l_spe = settings->specular *
+                pow(max(vec3_dot(r, *view), 0), settings->shininess);
+    }
+    ret = vec3_mul(*albedo, settings->diffuse * s_dot_n);
+    vec3_iaddk(&ret, vec3(1, 1, 1), l_spe);
+    return vec3_mul(ret, visibility * pt->intensity);
+}
+
+// Trace a camera ray.  Return false if we didn't hit anything.
+static bool trace(const pathtracer_t *pt, vec3_t o, vec3_t d,
+                  uint32_t *s, vec3_t *out)
+{
+    int bounce;
+    vec3_t pos, n, albedo, view, l = vec3_zero, t = vec3(1, 1, 1);
+
+    if (!cast(pt, &o, &d, &pos, &n, &albedo)) return false;
+    for (bounce = 0; ; bounce++) {
+        view = vec3_neg(d);
+        t = vec3(t.x * albedo.x, t.y * albedo.y, t.z * albedo.z);
+        vec3_iadd(&l, direct_light(pt, &pos, &n, &view, &t, bounce == 0));
+        if (bounce == MAX_BOUNCES) break;
+        o = vec3_addk(pos, n, 0.001);
+        d = sample_hemisphere(&n, s);
+        if (!cast(pt, &o, &d, &pos, &n, &albedo)) {
+            // Hit the sky.
+            vec3_iaddk(&l, t, pt->settings.ambient * pt->intensity);
+            break;
+        }
+    }
+    *out = l;
+    return true;
+}
+
+static void render_tile(int tile, void *user)
+{
+    pathtracer_t *pt = user;
+    int x, y, x0, y0, x1, y1;
+    uint32_t s;
+    vec4_t p0, p1;
+    vec3_t o, d, color;
+    float *acc;
+
+    x0 = (tile % pt->nb_tiles[0]) * TILE_SIZE;
+    y0 = (tile / pt->nb_tiles[0]) * TILE_SIZE;
+    x1 = min(x0 + TILE_SIZE, pt->w);
+    y1 = min(y0 + TILE_SIZE, pt->h);
+
+    for (y = y0; y < y1; y++)
+    for (x = x0; x < x1; x++) {
+        s = hash32(hash32(hash32(x) ^ y) ^ pt->samples) | 1;
+        // Jittered ray in normalized device coordinates.
+        p0 = vec4(2 * (x + rnd(&s)) / pt->w - 1,
+                  2 * (y + rnd(&s)) / pt->h - 1, -1, 1);
+        p1 = p0;
+        p1.z = 1;
+        p0 = mat4_mul_vec(pt->inv_vp, p0);
+        p1 = mat4_mul_vec(pt->inv_vp, p1);
+        o = vec3(p0.x / p0.w, p0.y / p0.w, p0.z / p0.w);
+        d = vec3_normalized(vec3_sub(
+                    vec3(p1.x / p1.w, p1.y / p1.w, p1.z / p1.w), o));
+        if (!trace(pt, o, d, &s, &color)) continue;
+        // The image rows go from top to bottom.
+        acc = &pt->acc[((size_t)(pt->h - y - 1) * pt->w + x) * 4];
+        acc[0] += color.r;
+        acc[1] += color.g;
+        acc[2] += color.b;
+        acc[3] += 1;
+    }
+}
+
+pathtracer_t *pathtracer_create(const renderer_t *rend, const mesh_t *mesh,
+                                int w, int h)
+{
+    pathtracer_t *pt = calloc(1, sizeof(*pt));
+    pt->mesh = mesh;
+    pt->settings = rend->settings;
+    pt->intensity = rend->light.intensity;
+    pt->w = w;
+    pt->h = h;
+    pt->inv_vp = mat4_inverted(mat4_mul(rend->proj_mat, rend->view_mat));
+    pt->light_dir = render_get_light_dir(rend);
+    mesh_get_blocks_bounds(mesh, pt->bounds[0], pt->bounds[1]);
+    pt->nb_tiles[0] = (w + TILE_SIZE - 1) / TILE_SIZE;
+    pt->nb_tiles[1] = (h + TILE_SIZE - 1) / TILE_SIZE;
+    pt->acc = calloc((size_t)w * h * 4, sizeof(*pt->acc));
+    return pt;
+}
+
+void pathtracer_delete(pathtracer_t *pt)
+{
+    if (!pt) return;
+    free(pt->acc);
+    free(pt);
+}
+
+void pathtracer_iter(pathtracer_t *pt)
+{
+    parallel_for(pt->nb_tiles[0] * pt->nb_tiles[1], render_tile, pt);
+    pt->samples++;
+}
+
+int pathtracer_get_samples(const pathtracer_t *pt)
+{
+    return pt->samples;
+}
+
+void pathtracer_get_image(const pathtracer_t *pt, uint8_t *out)
+{
+    size_t i;
+    int k;
+    const float *acc;
+    for (i = 0; i < (size_t)pt->w * pt->h; i++) {
+        acc = &pt->acc[i * 4];
+        out[i * 4 + 3] = pt->samples ? acc[3] / pt->samples * 255 : 0;
+        for (k = 0; k < 3; k++) {
+            out[i * 4 + k] = acc[3] ? clamp(acc[k] / acc[3], 0, 1) * 255
+                                    : 0;
+        }
+    }
+}
@@ -21,6 +21,9 @@
 
 #include "goxel.h"
 #include <stdarg.h>
+#ifndef __EMSCRIPTEN__
+#   include <pthread.h>
+#endif
 
 #define NODES \
     X(PROG) \
@@ -64,6 +67,28 @@
     X(life, 1) \
     X(antialiased, 1) \
 
+// List of expression bytecode instructions, with their id in the AST
+// and the number of values they pop from the stack.
+#define INSTRS \
+    X(END,      NULL, 1) \
+    X(CONST,    NULL, 0) \
+    X(VAR,      "var", 0) \
+    X(INT,      "int", 1) \
+    X(ADD,      "+",  2) \
+    X(SUB,      "-",  2) \
+    X(MUL,      "*",  2) \
+    X(DIV,      "/",  2) \
+    X(PLUSMIN,  "+-", 2) \
+    X(EQ,       "==", 2) \
+    X(NE,       "!=", 2) \
+    X(LT,       "<",  2) \
+    X(GT,       ">",  2) \
+    X(LE,       "<=", 2) \
+    X(GE,       ">=", 2) \
+    X(OR,       "||", 2) \
+    X(AND,      "&&", 2) \
+    X(SEL,      "?:", 3) \
+
 enum {
 #define X(x) NODE_##x,
     NODES
@@ -94,12 +119,54 @@ static op_info_t OP_INFOS[] = {
 #undef X
 };
 
+enum {
+#define X(id, ...) I_##id,
+    INSTRS
+#undef X
+    I_COUNT
+};
+
+static const struct {
+    const char *id;
+    int        nb;
+} INSTR_INFOS[] = {
+#define X(id, str, nb) [I_##id] = {str, nb},
+    INSTRS
+#undef X
+};
+
+typedef struct {
+    uint8_t     op;
+    uint8_t     var;    // For I_VAR.
+    float       v;      // For I_CONST.
+} instr_t;
+
+// Max depth of the expressions stack.
+#define VM_STACK_SIZE 64
+// Max number of variables in a shape.
+#define NB_VARS 4
+
 static const shape_t *SHAPES[] = {
     &shape_cube,
     &shape_sphere,
     &shape_cylinder,
 };
 
+// Range of the possible values of an expression.
+typedef struct {
+    double      lo, hi;
+} range_t;
+
+// Bound of the distance along each axis from the center of a context box
+// to the voxels it can write: at most |M| * rel + abs, where |M| is the
+// box matrix with all its values made positive.  We also keep a bound of
+// the distance in any direction: at most ||M|| * norm_rel + norm_abs, that
+// doesn't grow with the rotations.
+typedef struct {
+    double      rel[3], abs[3];
+    double      norm_rel, norm_abs;
+} bound_t;
+
 typedef struct proc_node node_t;
 struct proc_node {
     int         type;
@@ -109,6 +176,22 @@ struct proc_node {
     node_t      *children, *next, *prev, *parent;
     // Pos in the source code.
     int         line;
+    int         op;     // Index in OP_INFOS for the NODE_OP.
+    instr_t     *code;  // Compiled bytecode of the expressions.
+    // For the NODE_CALL, either the called NODE_SHAPE or the basic shape.
+    node_t      *target;
+    const shape_t *shape;
+    // For the NODE_RULE, probability to pick it if none of the previous
+    // rules of the shape has been picked.
+    float       proba;
+    // For the NODE_SHAPE, set if its voxels only depend on the box, color
+    // and variables of the calling context, see set_invariant_shapes.
+    bool        invariant;
+    // For the NODE_SHAPE and NODE_BLOCK, bound of the distance from the
+    // context box center to the voxels it can write, see set_bounds.
+    bound_t     bound;
+    // For the NODE_SHAPE, range of the variables at the start of its rules.
+    range_t     vars[NB_VARS];
 };
 
 typedef struct proc_ctx ctx_t;
@@ -120,10 +203,15 @@ struct proc_ctx {
     bool        antialiased;
     uint32_t    seed;
     node_t      *prog;
-    float       vars[4];
+    float       vars[NB_VARS];
     int         wait;
     int         life;
     bool        last;   // Mark the end of a frame.
+    // Set if the context stamps the generation 'gen' of an instance
+    // instead of running its block, see call_instance.
+    struct proc_template *instance;
+    int         gen;
+    vec3i_t     offset;
 };
 
 // Move a value toward a target.  If v is positive, move the value toward
@@ -155,19 +243,89 @@ static void node_free(node_t *node)
         node_free(c);
     }
     free(node->id);
+    free(node->code);
     free(node);
 }
 
-static void ctxs_free(ctx_t *ctx)
+/*
+ * The contexts are allocated by chunks, and recycled in a free list, since
+ * we create and delete a lot of them.  The expansion threads take the
+ * contexts by small batches into their own free list (see job_ctx_new), so
+ * that they rarely need to lock the pool.
+ */
+
+#define CTX_CHUNK_SIZE 1024
+
+typedef struct proc_ctx_chunk ctx_chunk_t;
+struct proc_ctx_chunk {
+    ctx_chunk_t *next;
+    ctx_t       ctxs[CTX_CHUNK_SIZE];
+};
+
+// Detach up to n contexts from the pool free list.  Must be called with
+// the pool locked.
+static ctx_t *pool_take(gox_proc_t *proc, int n)
+{
+    ctx_chunk_t *chunk;
+    ctx_t *ret, *last;
+    int i;
+
+    if (!proc->pool.free) {
+        chunk = malloc(sizeof(*chunk));
+        LL_PREPEND(proc->pool.chunks, chunk);
+        for (i = CTX_CHUNK_SIZE - 1; i >= 0; i--)
+            LL_PREPEND(proc->pool.free, &chunk->ctxs[i]);
+    }
+    ret = last = proc->pool.free;
+    for (i = 1; i < n && last->next; i++)
+        last = last->next;
+    proc->pool.free = last->next;
+    last->next = NULL;
+    return ret;
+}
+
+static ctx_t *ctx_new(gox_proc_t *proc)
+{
+    ctx_t *ctx;
+
+    while (__sync_lock_test_and_set(&proc->pool.lock, 1)) {}
+    ctx = pool_take(proc, 1);
+    proc->stats.nb_ctxs++;
+    proc->stats.peak_ctxs = max(proc->stats.peak_ctxs, proc->stats.nb_ctxs);
+    __sync_lock_release(&proc->pool.lock);
+    memset(ctx, 0, sizeof(*ctx));
+    return ctx;
+}
+
+static void ctx_free(gox_proc_t *proc, ctx_t *ctx)
+{
+    while (__sync_lock_test_and_set(&proc->pool.lock, 1)) {}
+    LL_PREPEND(proc->pool.free, ctx);
+    proc->stats.nb_ctxs--;
+    __sync_lock_release(&proc->pool.lock);
+}
+
+static void ctxs_free(gox_proc_t *proc, ctx_t *ctx)
 {
     ctx_t *c, *tmp;
     if (!ctx) return;
     DL_FOREACH_SAFE(ctx, c, tmp) {
         DL_DELETE(ctx, c);
-        free(c);
+        ctx_free(proc, c);
     }
 }
 
+// Release all the memory used by the contexts.
+static void ctx_pool_release(gox_proc_t *proc)
+{
+    ctx_chunk_t *chunk, *tmp;
+    LL_FOREACH_SAFE(proc->pool.chunks, chunk, tmp)
+        free(chunk);
+    proc->pool.chunks = NULL;
+    proc->pool.free = NULL;
+    proc->stats.nb_ctxs = 0;
+}
+
 static int error(gox_proc_t *proc, node_t *node, const char *msg, ...)
 {
     va_list args;
@@ -176,7 +334,7 @@ static int error(gox_proc_t *proc, node_t *node, const char *msg, ...)
     vasprintf(&proc->error.str, msg, args);
     va_end(args);
     proc->error.line = node ? node->line : 0;
-    proc->state = PROC_DONE;
+    __atomic_store_n(&proc->state, PROC_DONE, __ATOMIC_RELEASE);
     return -1;
 }
 
@@ -220,80 +378,696 @@ static float plusmin(float a, float b, uint32_t *seed)
     return frand(a - b, a + b, seed);
 }
 
-// Evaluate an expression node.
-static float evaluate(node_t *node, ctx_t *ctx)
+static node_t *find_shape(node_t *prog, const char *id)
 {
-    float a, b, c;
-    if (node->type == NODE_VALUE) return node->v;
-    assert(node->type == NODE_EXPR);
+    node_t *node;
+    DL_FOREACH(prog->children, node) {
+        if (node->type == NODE_SHAPE && strcmp(node->id, id) == 0)
+            return node;
+    }
+    return NULL;
+}
 
-    if (str_equ(node->id, "var")) {
-        assert(node->v > 0);
-        return ctx->vars[(int)node->v - 1];
-    }
-    a = evaluate(node->children, ctx);
-
-    if (str_equ(node->id, "int"))
-        return round(a);
-
-    b = evaluate(node->children->next, ctx);
-    if (str_equ(node->id, "+"))
-        return a + b;
-    if (str_equ(node->id, "-"))
-        return a - b;
-    if (str_equ(node->id, "*"))
-        return a * b;
-    if (str_equ(node->id, "/"))
-        return a / b;
-    if (str_equ(node->id, "+-"))
-        return plusmin(a, b, &ctx->seed);
-    if (str_equ(node->id, "=="))
-        return (a == b) ? 1 : 0;
-    if (str_equ(node->id, "!="))
-        return (a != b) ? 1 : 0;
-    if (str_equ(node->id, "<"))
-        return (a < b) ? 1 : 0;
-    if (str_equ(node->id, ">"))
-        return (a > b) ? 1 : 0;
-    if (str_equ(node->id, "<="))
-        return (a <= b) ? 1 : 0;
-    if (str_equ(node->id, ">="))
-        return (a >= b) ? 1 : 0;
-    if (str_equ(node->id, "||"))
-        return (a || b) ? 1 : 0;
-    if (str_equ(node->id, "&&"))
-        return (a && b) ? 1 : 0;
-
-    c = evaluate(node->children->next->next, ctx);
-    if (str_equ(node->id, "?:"))
-        return a ? b : c;
+static float run(const instr_t *code, ctx_t *ctx)
+{
+    float stack[VM_STACK_SIZE], *s = stack;
+    for (;; code++) {
+        switch (code->op) {
+        case I_END:     return s[-1];
+        case I_CONST:   *s++ = code->v; break;
+        case I_VAR:     *s++ = ctx->vars[code->var]; break;
+        case I_INT:     s[-1] = round(s[-1]); break;
+        case I_ADD:     s--; s[-1] = s[-1] + s[0]; break;
+        case I_SUB:     s--; s[-1] = s[-1] - s[0]; break;
+        case I_MUL:     s--; s[-1] = s[-1] * s[0]; break;
+        case I_DIV:     s--; s[-1] = s[-1] / s[0]; break;
+        case I_PLUSMIN: s--; s[-1] = plusmin(s[-1], s[0], &ctx->seed); break;
+        case I_EQ:      s--; s[-1] = (s[-1] == s[0]) ? 1 : 0; break;
+        case I_NE:      s--; s[-1] = (s[-1] != s[0]) ? 1 : 0; break;
+        case I_LT:      s--; s[-1] = (s[-1] <  s[0]) ? 1 : 0; break;
+        case I_GT:      s--; s[-1] = (s[-1] >  s[0]) ? 1 : 0; break;
+        case I_LE:      s--; s[-1] = (s[-1] <= s[0]) ? 1 : 0; break;
+        case I_GE:      s--; s[-1] = (s[-1] >= s[0]) ? 1 : 0; break;
+        case I_OR:      s--; s[-1] = (s[-1] || s[0]) ? 1 : 0; break;
+        case I_AND:     s--; s[-1] = (s[-1] && s[0]) ? 1 : 0; break;
+        case I_SEL:     s -= 2; s[-1] = s[-1] ? s[0] : s[1]; break;
+        default:        assert(false);
+        }
+    }
+}
 
-    assert(false);
-    return 0;
+// Evaluate a compiled expression node.
+static float evaluate(const node_t *node, ctx_t *ctx)
+{
+    assert(node->code);
+    return run(node->code, ctx);
 }
 
+/*
+ * Expressions compiler.
+ *
+ * The expressions are compiled at parse time into a small stack machine
+ * code, in postfix order, so that the '+-' random values are generated in
+ * the same order as when we used to walk the tree.  The sub expressions
+ * that don't depend on any variable or random value are folded into a
+ * single constant, computed with the same code as at runtime.
+ */
+
+typedef struct {
+    instr_t     *data;
+    int         nb;
+    int         size;
+} code_t;
 
-static node_t *get_rule(node_t *prog, const char *id, ctx_t *ctx)
+static void emit(code_t *code, int op, int var, float v)
 {
-    node_t *node, *c;
-    float tot = 0;
-    DL_FOREACH(prog->children, node) {
-        if (    node->type == NODE_SHAPE &&
-                strcmp(node->id, id) == 0) break;
+    if (code->nb == code->size) {
+        code->size = max(code->size * 2, 16);
+        code->data = realloc(code->data, code->size * sizeof(*code->data));
+    }
+    code->data[code->nb++] = (instr_t) {.op = op, .var = var, .v = v};
+}
+
+static int compile_expr(gox_proc_t *proc, node_t *node, code_t *code)
+{
+    node_t *c;
+    int op, i, start = code->nb;
+    bool fold;
+    ctx_t ctx = {};
+    float v;
+
+    if (node->type == NODE_VALUE) {
+        emit(code, I_CONST, 0, node->v);
+        return 0;
+    }
+    assert(node->type == NODE_EXPR);
+    for (op = I_VAR; op < I_COUNT; op++) {
+        if (str_equ(INSTR_INFOS[op].id, node->id)) break;
+    }
+    if (op == I_COUNT)
+        return error(proc, node, "Unknown function '%s'", node->id);
+    if (node->size != INSTR_INFOS[op].nb)
+        return error(proc, node, "Wrong number of arguments for '%s'",
+                     node->id);
+    if (op == I_VAR) {
+        if (node->v < 1 || node->v > NB_VARS)
+            return error(proc, node, "Too many variables");
+        emit(code, I_VAR, node->v - 1, 0);
+        return 0;
     }
-    if (!node) return NULL;
-    if (node->children->type == NODE_BLOCK)
-        return node->children;
-    // Get the total proba.
     DL_FOREACH(node->children, c) {
+        TRY(compile_expr(proc, c, code));
+    }
+    emit(code, op, 0, 0);
+
+    // Constant folding.
+    fold = op != I_PLUSMIN;
+    for (i = start; fold && i < code->nb - 1; i++)
+        fold = code->data[i].op == I_CONST;
+    if (fold) {
+        emit(code, I_END, 0, 0);
+        v = run(code->data + start, &ctx);
+        code->nb = start;
+        emit(code, I_CONST, 0, v);
+    }
+    return 0;
+}
+
+static int compile_root(gox_proc_t *proc, node_t *node)
+{
+    code_t code = {};
+    int i, depth = 0, r;
+
+    r = compile_expr(proc, node, &code);
+    emit(&code, I_END, 0, 0);
+    for (i = 0; !r && i < code.nb; i++) {
+        depth += 1 - INSTR_INFOS[code.data[i].op].nb;
+        if (depth > VM_STACK_SIZE)
+            r = error(proc, node, "Expression too complex");
+    }
+    if (r) {
+        free(code.data);
+        return r;
+    }
+    node->code = code.data;
+    return 0;
+}
+
+static int resolve_op(gox_proc_t *proc, node_t *node)
+{
+    int op, n = node->size;
+    for (op = 0; op < OP_COUNT; op++) {
+        if (strcmp(OP_INFOS[op].id, node->id) == 0)
+            break;
+    }
+    if (op == OP_COUNT) return error(proc, node, "No op '%s'", node->id);
+    if (!(  (!n && n == OP_INFOS[op].nb[0]) ||
+            ( n && n == OP_INFOS[op].nb[0]) ||
+            ( n && n == OP_INFOS[op].nb[1]) ||
+            ( n && n == OP_INFOS[op].nb[2])))
+        return error(proc, node,
+                     "Op '%s' does not accept %d arguments", node->id, n);
+    node->op = op;
+    return 0;
+}
+
+// We pick each rule in turn with the probability of its weight over the
+// total weight of the remaining rules.  This gives the same random sequence
+// as when we computed it at each call.
+static void set_rules_probas(node_t *shape)
+{
+    node_t *c;
+    float tot = 0;
+    if (shape->children->type == NODE_BLOCK) return;
+    DL_FOREACH(shape->children, c) {
         assert(c->type == NODE_RULE);
         tot += c->v;
     }
-    // Now pick one rule randomly.
+    DL_FOREACH(shape->children, c) {
+        c->proba = c->v / tot;
+        tot -= c->v;
+    }
+    // Make sure we always pick one, even with rounding errors.
+    shape->children->prev->proba = 1;
+}
+
+static int resolve_call(gox_proc_t *proc, node_t *node)
+{
+    int i;
+    // The basic shapes have priority over the user defined ones.
+    for (i = 0; i < ARRAY_SIZE(SHAPES); i++) {
+        if (str_equ(node->id, SHAPES[i]->id)) {
+            node->shape = SHAPES[i];
+            return 0;
+        }
+    }
+    node->target = find_shape(proc->prog, node->id);
+    if (!node->target)
+        return error(proc, node, "Cannot find rule %s", node->id);
+    return 0;
+}
+
+// Compile all the expressions of the program, and resolve the transformation
+// ops and the calls, so that we don't need any string comparison when we
+// run it.
+static int compile(gox_proc_t *proc, node_t *node)
+{
+    node_t *c;
+    if (node->type == NODE_EXPR || node->type == NODE_VALUE)
+        return compile_root(proc, node);
+    if (node->type == NODE_OP)
+        TRY(resolve_op(proc, node));
+    if (node->type == NODE_CALL)
+        TRY(resolve_call(proc, node));
+    if (node->type == NODE_SHAPE)
+        set_rules_probas(node);
+    if ((IS_IN(node->type, NODE_SET, NODE_LOOP) && node->v > NB_VARS) ||
+        (node->type == NODE_ARGS && node->size > NB_VARS))
+        return error(proc, node, "Too many variables");
+    DL_FOREACH(node->children, c) {
+        TRY(compile(proc, c));
+    }
+    return 0;
+}
+
+// Check that a node doesn't use any random value, or any op that would make
+// its voxels depend on anything else than its context box, color and
+// variables.
+static bool is_invariant(const node_t *node)
+{
+    const node_t *c;
+    const instr_t *instr;
+    for (instr = node->code; instr && instr->op != I_END; instr++) {
+        if (instr->op == I_PLUSMIN) return false;
+    }
+    if (node->type == NODE_OP &&
+            IS_IN(node->op, OP_sub, OP_paint, OP_wait, OP_life))
+        return false;
+    if (node->type == NODE_CALL && node->target && !node->target->invariant)
+        return false;
     DL_FOREACH(node->children, c) {
-        if (frand(0, 1, &ctx->seed) <= c->v / tot)
+        if (!is_invariant(c)) return false;
+    }
+    return true;
+}
+
+// Find the shapes with a single rule that only call invariant shapes.
+// Since the shapes can be recursive, we start with all of them, and remove
+// the ones that fail until nothing changes.
+static void set_invariant_shapes(node_t *prog)
+{
+    node_t *shape;
+    bool changed = true;
+    DL_FOREACH(prog->children, shape) {
+        shape->invariant = shape->type == NODE_SHAPE &&
+                           shape->children->type == NODE_BLOCK;
+    }
+    while (changed) {
+        changed = false;
+        DL_FOREACH(prog->children, shape) {
+            if (shape->invariant && !is_invariant(shape->children)) {
+                shape->invariant = false;
+                changed = true;
+            }
+        }
+    }
+}
+
+/*
+ * Bounds.
+ *
+ * When we clip the program, we want to skip the contexts that can't write
+ * anything inside the clip volume.  For that we compute at parse time, for
+ * each block, a bound of the distance along each axis from the center of
+ * the context box to all the voxels that the block can write, either
+ * directly or through the contexts it creates.
+ *
+ * We don't know the values of the expressions at parse time, so we run the
+ * program on ranges of values instead, and only keep the absolute values
+ * of the transformations matrices, and a bound of their norms.  The
+ * bound of a recursive shape depends on itself, so we iterate over all the
+ * shapes until nothing changes.
+ * Anything we can't bound, like a recursion that doesn't scale down, gets
+ * BOUND_MAX, and is never skipped.
+ *
+ * We use doubles clamped to BOUND_MAX rather than infinity, since the
+ * release build uses -ffast-math.
+ */
+
+#define BOUND_MAX 1e30
+// Number of passes after which we inflate the bounds that still change, to
+// converge faster, and after which we give up.
+#define BOUNDS_INFLATE_PASS 16
+#define BOUNDS_MAX_PASSES 64
+// Max number of iterations of a loop transformation that we bound.
+#define BOUNDS_MAX_LOOP 1024
+
+static const range_t RANGE_ALL = {-BOUND_MAX, BOUND_MAX};
+static const range_t RANGE_EMPTY = {BOUND_MAX, -BOUND_MAX};
+
+// Bound of a transformation relative to a context box: the absolute values
+// of its translation are at most |M| * t.rel + t.abs, and the ones of its
+// matrix |M| * s_rel + s_abs.  The norm of the matrix is at most
+// ||M|| * n_rel + n_abs.  The abs values are the ones set by 'sn'.
+typedef struct {
+    bound_t     t;
+    double      s_rel[3][3];
+    double      s_abs[3][3];
+    double      n_rel, n_abs;
+} transf_bound_t;
+
+static double clamp_bound(double v)
+{
+    return min(v, BOUND_MAX);
+}
+
+static void max_values(double *a, const double *b, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) a[i] = max(a[i], b[i]);
+}
+
+static range_t range_clamp(double lo, double hi)
+{
+    return (range_t){max(lo, -BOUND_MAX), min(hi, BOUND_MAX)};
+}
+
+static range_t range_merge(range_t a, range_t b)
+{
+    return (range_t){min(a.lo, b.lo), max(a.hi, b.hi)};
+}
+
+static double range_abs(range_t r)
+{
+    return max(fabs(r.lo), fabs(r.hi));
+}
+
+static range_t range_mul(range_t a, range_t b)
+{
+    double p[4] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+    return range_clamp(min(min(p[0], p[1]), min(p[2], p[3])),
+                       max(max(p[0], p[1]), max(p[2], p[3])));
+}
+
+// Max of |cos(x)| for x in a range of radians.
+static double range_max_cos(range_t r)
+{
+    if (r.hi - r.lo >= M_PI || floor(r.lo / M_PI) != floor(r.hi / M_PI))
+        return 1;
+    // Add a bit for the rounding errors of the runtime matrices.
+    return min(max(fabs(cos(r.lo)), fabs(cos(r.hi))) + 1e-5, 1.0);
+}
+
+// Same as run, but on ranges of values.
+static range_t run_range(const instr_t *code, const range_t *vars)
+{
+    range_t stack[VM_STACK_SIZE], *s = stack, a, b;
+    double v;
+    for (;; code++) {
+        if (code->op == I_END) return s[-1];
+        if (code->op == I_CONST) {
+            *s++ = (range_t){code->v, code->v};
+            continue;
+        }
+        if (code->op == I_VAR) {
+            *s++ = vars[code->var];
+            continue;
+        }
+        if (code->op == I_INT) {
+            s[-1] = (range_t){round(s[-1].lo), round(s[-1].hi)};
+            continue;
+        }
+        s -= INSTR_INFOS[code->op].nb - 1;
+        a = s[-1];
+        b = s[0];
+        switch (code->op) {
+        case I_ADD:     s[-1] = range_clamp(a.lo + b.lo, a.hi + b.hi); break;
+        case I_SUB:     s[-1] = range_clamp(a.lo - b.hi, a.hi - b.lo); break;
+        case I_MUL:     s[-1] = range_mul(a, b); break;
+        case I_DIV:
+            if (b.lo <= 0 && b.hi >= 0) s[-1] = RANGE_ALL;
+            else s[-1] = range_mul(a, (range_t){1 / b.hi, 1 / b.lo});
+            break;
+        case I_PLUSMIN:
+            v = range_abs(b);
+            s[-1] = range_clamp(a.lo - v, a.hi + v);
+            break;
+        case I_SEL:     s[-1] = range_merge(s[0], s[1]); break;
+        default:        s[-1] = (range_t){0, 1}; break; // Comparisons.
+        }
+    }
+}
+
+// Multiply the transformation matrix by a matrix of positive values.
+static void bound_mul(transf_bound_t *b, const double m[3][3])
+{
+    double rel[3][3] = {}, abs[3][3] = {};
+    int i, j, k;
+    for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++)
+    for (k = 0; k < 3; k++) {
+        rel[i][j] += b->s_rel[i][k] * m[k][j];
+        abs[i][j] += b->s_abs[i][k] * m[k][j];
+    }
+    for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++) {
+        b->s_rel[i][j] = clamp_bound(rel[i][j]);
+        b->s_abs[i][j] = clamp_bound(abs[i][j]);
+    }
+}
+
+static void bound_scale(transf_bound_t *b, double x, double y, double z)
+{
+    const double m[3][3] = {{x, 0, 0}, {0, y, 0}, {0, 0, z}};
+    bound_mul(b, m);
+    b->n_rel = clamp_bound(b->n_rel * max3(x, y, z));
+    b->n_abs = clamp_bound(b->n_abs * max3(x, y, z));
+}
+
+static void bound_rotate(transf_bound_t *b, range_t a, int axis)
+{
+    double m[3][3] = {}, c, s;
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    a = range_mul(a, (range_t){M_PI / 180, M_PI / 180});
+    c = range_max_cos(a);
+    s = range_max_cos((range_t){a.lo - M_PI / 2, a.hi - M_PI / 2});
+    m[axis][axis] = 1;
+    m[u][u] = m[v][v] = c;
+    m[u][v] = m[v][u] = s;
+    bound_mul(b, m);
+}
+
+static void bound_translate(transf_bound_t *b, double x, double y, double z)
+{
+    const double d[3] = {x, y, z};
+    double len = sqrt(x * x + y * y + z * z);
+    int i, j;
+    for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++) {
+        b->t.rel[i] = clamp_bound(b->t.rel[i] + b->s_rel[i][j] * d[j]);
+        b->t.abs[i] = clamp_bound(b->t.abs[i] + b->s_abs[i][j] * d[j]);
+    }
+    b->t.norm_rel = clamp_bound(b->t.norm_rel + b->n_rel * len);
+    b->t.norm_abs = clamp_bound(b->t.norm_abs + b->n_abs * len);
+}
+
+// Same as apply_transf, but on the bound of the transformation.
+static void bound_transf(const node_t *node, const range_t *vars,
+                         transf_bound_t *b)
+{
+    const node_t *c;
+    range_t r[3] = {};
+    double v[3] = {0}, size;
+    int i, j, n;
+
+    if (node->type == NODE_TRANSF) {
+        DL_FOREACH(node->children, c)
+            bound_transf(c, vars, b);
+        return;
+    }
+    n = node->size;
+    for (i = 0, c = node->children; i < n; i++, c = c->next) {
+        r[i] = run_range(c->code, vars);
+        v[i] = range_abs(r[i]);
+    }
+
+    switch (node->op) {
+    case OP_sx:
+        bound_scale(b, v[0], 1, 1);
+        break;
+    case OP_sy:
+        bound_scale(b, 1, v[0], 1);
+        break;
+    case OP_sz:
+        bound_scale(b, 1, 1, v[0]);
+        break;
+    case OP_s:
+        if (n == 1) v[1] = v[2] = v[0];
+        bound_scale(b, v[0], v[1], v[2]);
+        break;
+    case OP_sn:
+        // Without value sn only scales down, otherwise it sets the size of
+        // the box axes to v / 2, whatever the context box.
+        if (n == 0 || (r[0].lo == 0 && r[0].hi == 0)) break;
+        size = v[0] / 2;
+        for (i = 0; i < 3; i++)
+        for (j = 0; j < 3; j++) {
+            if (r[0].lo > 0 || r[0].hi < 0) b->s_rel[i][j] = 0;
+            b->s_abs[i][j] = max(b->s_abs[i][j], size);
+        }
+        if (r[0].lo > 0 || r[0].hi < 0) b->n_rel = 0;
+        b->n_abs = max(b->n_abs, size * sqrt(3));
+        break;
+    case OP_x:
+        bound_translate(b, 2 * v[0], 2 * v[1], 2 * v[2]);
+        break;
+    case OP_y:
+        bound_translate(b, 0, 2 * v[0], 2 * v[1]);
+        break;
+    case OP_z:
+        bound_translate(b, 0, 0, 2 * v[0]);
+        break;
+    case OP_rx:
+        bound_rotate(b, r[0], 0);
+        break;
+    case OP_ry:
+        bound_rotate(b, r[0], 1);
+        break;
+    case OP_rz:
+        bound_rotate(b, r[0], 2);
+        break;
+    }
+}
+
+static void bound_max(bound_t *a, const bound_t *b)
+{
+    max_values(a->rel, b->rel, 3);
+    max_values(a->abs, b->abs, 3);
+    a->norm_rel = max(a->norm_rel, b->norm_rel);
+    a->norm_abs = max(a->norm_abs, b->norm_abs);
+}
+
+// Merge into ret the bound of a block run in a box transformed by b.
+static void bound_apply(bound_t *ret, const transf_bound_t *b,
+                        const bound_t *bound)
+{
+    bound_t r = b->t;
+    int i, j;
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            r.rel[i] += b->s_rel[i][j] * bound->rel[j];
+            r.abs[i] += b->s_abs[i][j] * bound->rel[j];
+        }
+        r.rel[i] = clamp_bound(r.rel[i]);
+        r.abs[i] = clamp_bound(r.abs[i] + bound->abs[i]);
+    }
+    r.norm_rel = clamp_bound(r.norm_rel + b->n_rel * bound->norm_rel);
+    r.norm_abs = clamp_bound(r.norm_abs + b->n_abs * bound->norm_rel +
+                             bound->norm_abs);
+    bound_max(ret, &r);
+}
+
+// Merge the values of the variables of a call into the ranges of the
+// called shape.
+static bool bound_call_vars(node_t *shape, const range_t *vars, bool widen)
+{
+    range_t r;
+    int i;
+    bool changed = false;
+    for (i = 0; i < NB_VARS; i++) {
+        r = range_merge(shape->vars[i], vars[i]);
+        if (r.lo == shape->vars[i].lo && r.hi == shape->vars[i].hi)
+            continue;
+        shape->vars[i] = widen ? RANGE_ALL : r;
+        changed = true;
+    }
+    return changed;
+}
+
+// Compute the bound of a block, and of all the blocks it runs in new
+// contexts, with the given ranges of the variables at its start.
+static bound_t bound_block(node_t *block, const range_t *vars_,
+                           bool widen, bool *changed)
+{
+    node_t *expr, *c, *body;
+    range_t vars[NB_VARS], body_vars[NB_VARS], n;
+    transf_bound_t b = {}, b2, prev;
+    const bound_t cube = {{1, 1, 1}, {0, 0, 0}, sqrt(3), 0};
+    bound_t ret = {};
+    int i;
+
+    b.s_rel[0][0] = b.s_rel[1][1] = b.s_rel[2][2] = 1;
+    b.n_rel = 1;
+    memcpy(vars, vars_, sizeof(vars));
+    DL_FOREACH(block->children, expr) {
+        if (expr->type == NODE_LOOP) {
+            n = run_range(expr->children->code, vars);
+            body = expr->children->next->next;
+            memcpy(body_vars, vars, sizeof(vars));
+            if (expr->v)
+                body_vars[(int)expr->v - 1] = range_clamp(0, n.hi - 1);
+            body->bound = bound_block(body, body_vars, widen, changed);
+            // The context i gets the loop transformation i times.
+            b2 = b;
+            bound_apply(&ret, &b2, &body->bound);
+            for (i = 1; i < n.hi; i++) {
+                if (i == BOUNDS_MAX_LOOP) {
+                    ret = (bound_t){{BOUND_MAX, BOUND_MAX, BOUND_MAX},
+                                    {BOUND_MAX, BOUND_MAX, BOUND_MAX},
+                                    BOUND_MAX, BOUND_MAX};
+                    break;
+                }
+                prev = b2;
+                bound_transf(expr->children->next, vars, &b2);
+                if (!memcmp(&prev, &b2, sizeof(b2))) break;
+                bound_apply(&ret, &b2, &body->bound);
+            }
+        }
+        if (expr->type == NODE_TRANSFB) {
+            b2 = b;
+            bound_transf(expr->children, vars, &b2);
+            body = expr->children->next;
+            body->bound = bound_block(body, vars, widen, changed);
+            bound_apply(&ret, &b2, &body->bound);
+        }
+        if (expr->type == NODE_IF) {
+            // Run in a copy of the context.
+            body = expr->children->next;
+            body->bound = bound_block(body, vars, widen, changed);
+            bound_apply(&ret, &b, &body->bound);
+        }
+        if (expr->type == NODE_SET)
+            vars[(int)expr->v - 1] = run_range(expr->children->code, vars);
+        if (expr->type == NODE_TRANSF)
+            bound_transf(expr, vars, &b);
+        if (expr->type == NODE_CALL) {
+            b2 = b;
+            bound_transf(expr->children, vars, &b2);
+            if (expr->shape) {
+                bound_apply(&ret, &b2, &cube);
+                continue;
+            }
+            memcpy(body_vars, vars, sizeof(vars));
+            i = 0;
+            DL_FOREACH(expr->children->next->children, c)
+                body_vars[i++] = run_range(c->code, vars);
+            if (bound_call_vars(expr->target, body_vars, widen))
+                *changed = true;
+            bound_apply(&ret, &b2, &expr->target->bound);
+        }
+    }
+    return ret;
+}
+
+// Grow a value of a shape bound to a new value computed during the pass.
+// The values that still change after a few passes get inflated, so that we
+// converge faster, and we give up on them after too many passes.  Each
+// value is done separately, so that the norm bound can still converge when
+// the rotations make the per axis bound grow forever.
+static bool bound_grow(double *v, double new, int pass)
+{
+    if (new <= *v) return false;
+    if (pass >= BOUNDS_MAX_PASSES)
+        *v = BOUND_MAX;
+    else if (pass >= BOUNDS_INFLATE_PASS)
+        *v = clamp_bound(new * 2 + 1);
+    else
+        *v = new;
+    return true;
+}
+
+// Compute the bounds of all the blocks of the program.
+static void set_bounds(node_t *prog)
+{
+    node_t *shape, *rule, *block, *main_shape;
+    const range_t zero = {0, 0};
+    bound_t bound;
+    bool changed = true;
+    int pass, i;
+
+    DL_FOREACH(prog->children, shape) {
+        memset(&shape->bound, 0, sizeof(shape->bound));
+        for (i = 0; i < NB_VARS; i++) shape->vars[i] = RANGE_EMPTY;
+    }
+    main_shape = find_shape(prog, "main");
+    if (!main_shape) return;
+    // The first context has all its variables set to zero.
+    for (i = 0; i < NB_VARS; i++) main_shape->vars[i] = zero;
+
+    for (pass = 0; changed; pass++) {
+        changed = false;
+        DL_FOREACH(prog->children, shape) {
+            // Not called.
+            if (shape->vars[0].lo > shape->vars[0].hi) continue;
+            memset(&bound, 0, sizeof(bound));
+            DL_FOREACH(shape->children, rule) {
+                block = rule->type == NODE_BLOCK ? rule : rule->children;
+                block->bound = bound_block(block, shape->vars,
+                                           pass >= BOUNDS_INFLATE_PASS,
+                                           &changed);
+                bound_max(&bound, &block->bound);
+                if (rule->type == NODE_BLOCK) break;
+            }
+            for (i = 0; i < 3; i++) {
+                changed |= bound_grow(&shape->bound.rel[i], bound.rel[i], pass);
+                changed |= bound_grow(&shape->bound.abs[i], bound.abs[i], pass);
+            }
+            changed |= bound_grow(&shape->bound.norm_rel, bound.norm_rel, pass);
+            changed |= bound_grow(&shape->bound.norm_abs, bound.norm_abs, pass);
+        }
+    }
+}
+
+// Pick the block to run for a shape.  The rules probabilities are computed
+// at parse time by set_rules_probas.
+static node_t *get_rule(const node_t *shape, ctx_t *ctx)
+{
+    node_t *c;
+    if (shape->children->type == NODE_BLOCK)
+        return shape->children;
+    DL_FOREACH(shape->children, c) {
+        if (frand(0, 1, &ctx->seed) <= c->proba)
             return c->children;
-        tot -= c->v;
     }
     assert(false);
     return NULL;
@@ -314,7 +1088,7 @@ static int apply_transf(gox_proc_t *proc, node_t *node, ctx_t *ctx)
 {
     node_t *c;
     float v[3] = {0};
-    int i, n, op;
+    int i, n;
     assert(node->type == NODE_TRANSF || node->type == NODE_OP);
 
     if (node->type == NODE_TRANSF) {
@@ -324,23 +1098,11 @@ static int apply_transf(gox_proc_t *proc, node_t *node, ctx_t *ctx)
         return 0;
     }
 
-    for (op = 0; op < OP_COUNT; op++) {
-        if (strcmp(OP_INFOS[op].id, node->id) == 0)
-            break;
-    }
-    if (op == OP_COUNT) return error(proc, node, "No op '%s'", node->id);
-    DL_COUNT(node->children, c, n);
-    if (!(  (!n && n == OP_INFOS[op].nb[0]) ||
-            ( n && n == OP_INFOS[op].nb[0]) ||
-            ( n && n == OP_INFOS[op].nb[1]) ||
-            ( n && n == OP_INFOS[op].nb[2])))
-        return error(proc, node,
-                     "Op '%s' does not accept %d arguments", node->id, n);
-
+    n = node->size;
     for (i = 0, c = node->children; i < n; i++, c = c->next)
         v[i] = evaluate(c, ctx);
 
-    switch (op) {
+    switch (node->op) {
 
     case OP_sx:
         mat4_iscale(&ctx->box.mat, v[0], 1, 1);
@@ -422,39 +1184,262 @@ static int set_args(gox_proc_t *proc, node_t *node, ctx_t *ctx)
     return 0;
 }
 
-static void call_shape(const ctx_t *ctx, const shape_t *shape)
+/*
+ * Background thread.
+ *
+ * The thread runs the program on its own copy of the mesh, and regularly
+ * publishes a copy of it (cheap since the blocks are copy on write), that
+ * the main thread picks up in proc_sync.
+ */
+
+// Time between two published states of the mesh.
+#define THREAD_PUBLISH_PERIOD (100 * 1000000)
+
+typedef struct proc_thread proc_thread_t;
+struct proc_thread {
+#ifndef __EMSCRIPTEN__
+    pthread_t   thread;
+#endif
+    mesh_t      *mesh;      // Private copy of the mesh.
+    mesh_t      *snapshot;  // Last published state of the mesh.
+    int         lock;
+    bool        cancel;     // Set by the main thread to stop the thread.
+    bool        done;       // Set by the thread once finished.
+    bool        joined;
+};
+
+static mesh_t *get_mesh(const gox_proc_t *proc)
+{
+    return proc->thread ? proc->thread->mesh :
+                          goxel->image->active_layer->mesh;
+}
+
+static void add_shape(mesh_op_batch_t *batch, mesh_t *mesh,
+                      painter_t *painter, const ctx_t *ctx,
+                      const shape_t *shape)
 {
-    mesh_t *mesh = goxel->image->active_layer->mesh;
     uvec3b_t hsl = uvec3b(ctx->color.x / 360 * 255,
                           ctx->color.y * 255,
                           ctx->color.z * 255);
-    goxel->painter.color.rgb = hsl_to_rgb(hsl);
-    goxel->painter.shape = shape;
-    goxel->painter.mode = ctx->mode;
-    goxel->painter.smoothness = ctx->antialiased ? 1 : 0;
-    mesh_op(mesh, &goxel->painter, &ctx->box);
+    painter->color.rgb = hsl_to_rgb(hsl);
+    painter->shape = shape;
+    painter->mode = ctx->mode;
+    painter->smoothness = ctx->antialiased ? 1 : 0;
+    mesh_op_batch_add(batch, mesh, painter, &ctx->box);
+}
+
+static void call_shape(gox_proc_t *proc, const ctx_t *ctx,
+                       const shape_t *shape)
+{
+    // The shapes are applied at the end of the frame, see proc_iter.
+    if (!proc->batch) proc->batch = mesh_op_batch_new();
+    add_shape(proc->batch, get_mesh(proc), &proc->painter, ctx, shape);
+}
+
+// A shape emitted during the expansion of a context, the stamp of an
+// instance (ctx.instance set), or the call of an invariant shape that we
+// might instance.
+typedef struct {
+    ctx_t           ctx;
+    const shape_t   *shape;
+    ctx_t           *call; // The queued context of the call.
+} shape_op_t;
+
+// Voxelized shapes of an invariant shape call, see call_instance.
+typedef struct proc_template template_t;
+
+typedef struct {
+    const node_t    *prog;
+    box_t           box;
+    vec4_t          color;
+    float           vars[NB_VARS];
+    int             antialiased;
+} template_key_t;
+
+// The shapes emitted by the contexts of a given depth.
+typedef struct {
+    int             start;  // First shape in the template ops.
+    int             nb;
+    mesh_t          *mesh;  // The shapes voxelized, when first stamped.
+} template_gen_t;
+
+struct proc_template {
+    UT_hash_handle  hh;
+    template_key_t  key;
+    shape_op_t      *ops;
+    int             nb_ops;
+    template_gen_t  *gens;
+    int             nb_gens; // Zero if we couldn't expand the shape.
+    int             nb_calls;
+};
+
+// Result of the expansion of a single context.  The expansion only reads
+// the program and the context, so we can expand several contexts in
+// parallel, and then merge the results in the queue order to get the same
+// result as with a sequential expansion.
+typedef struct {
+    gox_proc_t  *proc;
+    ctx_t       *ctx;       // The context to expand.
+    ctx_t       *ctxs;      // New contexts to add to the queue.
+    ctx_t       *free;      // Contexts taken from the pool, not used yet.
+    int         nb_ctxs;    // Number of contexts created.
+    shape_op_t  *ops;       // Emitted shapes.
+    int         nb_ops;
+    int         size_ops;
+    int         r;
+    bool        in_template; // Set when we voxelize an instance.
+    struct {
+        node_t      *node;
+        const char  *msg;
+    } error;
+} expand_t;
+
+static int expand_error(expand_t *job, node_t *node, const char *msg)
+{
+    job->error.node = node;
+    job->error.msg = msg;
+    return -1;
+}
+
+static shape_op_t *add_op(expand_t *job)
+{
+    if (job->nb_ops == job->size_ops) {
+        job->size_ops = max(job->size_ops * 2, 16);
+        job->ops = realloc(job->ops, job->size_ops * sizeof(*job->ops));
+    }
+    return &job->ops[job->nb_ops++];
+}
+
+// Number of contexts a job takes at once from the pool.
+#define JOB_CTXS_BATCH 64
+
+static ctx_t *job_ctx_new(expand_t *job)
+{
+    gox_proc_t *proc = job->proc;
+    ctx_t *ctx;
+
+    if (!job->free) {
+        while (__sync_lock_test_and_set(&proc->pool.lock, 1)) {}
+        job->free = pool_take(proc, JOB_CTXS_BATCH);
+        __sync_lock_release(&proc->pool.lock);
+    }
+    ctx = job->free;
+    job->free = ctx->next;
+    job->nb_ctxs++;
+    memset(ctx, 0, sizeof(*ctx));
+    return ctx;
+}
+
+// Give the unused contexts of a job back to the pool, and account for the
+// ones it created.
+static void job_ctxs_merge(gox_proc_t *proc, expand_t *job)
+{
+    ctx_t *last;
+
+    while (__sync_lock_test_and_set(&proc->pool.lock, 1)) {}
+    if (job->free) {
+        for (last = job->free; last->next; last = last->next) {}
+        last->next = proc->pool.free;
+        proc->pool.free = job->free;
+        job->free = NULL;
+    }
+    proc->stats.nb_ctxs += job->nb_ctxs;
+    proc->stats.peak_ctxs = max(proc->stats.peak_ctxs, proc->stats.nb_ctxs);
+    job->nb_ctxs = 0;
+    __sync_lock_release(&proc->pool.lock);
+}
+
+static void emit_shape(expand_t *job, const ctx_t *ctx, const shape_t *shape)
+{
+    *add_op(job) = (shape_op_t){*ctx, shape};
+}
+
+// The shapes of an invariant shape don't depend on the random seed, so we
+// can stamp them from a template, see call_instance.  The stamps only work
+// with the OVER mode and an opaque color.  We don't instance the calls
+// inside an instance, since we expand them with it.
+static bool can_instance(const expand_t *job, const node_t *shape,
+                         const ctx_t *ctx)
+{
+    const proc_options_t *opts = &job->proc->run_options;
+    return opts->instancing && !job->in_template && shape->invariant &&
+           !opts->clip.enabled && ctx->mode == MODE_OVER &&
+           job->proc->painter.color.a == 255 && !ctx->wait && !ctx->life;
+}
+
+// Test if a shape box intersects the clip volume.
+static bool in_clip(const gox_proc_t *proc, const box_t *box)
+{
+    box_t bbox = box_get_bbox(*box);
+    bbox = bbox_grow(bbox, 1, 1, 1);
+    return bbox_intersect(bbox, proc->run_options.clip.box);
+}
+
+// Test if a context can write voxels inside the clip volume, from the bound
+// of its block, see set_bounds.  We add a voxel of margin for the
+// antialiasing, like in in_clip, and one for the rounding errors.
+static bool ctx_in_clip(const gox_proc_t *proc, const ctx_t *ctx)
+{
+    const bound_t *bound = &ctx->prog->bound;
+    const box_t *clip = &proc->run_options.clip.box;
+    double r, norm_r = BOUND_MAX;
+    int i;
+
+    // The Frobenius norm is larger than the matrix norm.
+    if (bound->norm_rel < BOUND_MAX && bound->norm_abs < BOUND_MAX) {
+        norm_r = sqrt(vec3_norm2(ctx->box.w) + vec3_norm2(ctx->box.h) +
+                      vec3_norm2(ctx->box.d)) * bound->norm_rel +
+                 bound->norm_abs;
+    }
+    for (i = 0; i < 3; i++) {
+        r = norm_r;
+        if (bound->rel[i] < BOUND_MAX && bound->abs[i] < BOUND_MAX) {
+            r = min(r, fabs(ctx->box.w.v[i]) * bound->rel[0] +
+                       fabs(ctx->box.h.v[i]) * bound->rel[1] +
+                       fabs(ctx->box.d.v[i]) * bound->rel[2] +
+                       bound->abs[i]);
+        }
+        if (r >= BOUND_MAX) continue;
+        r = r * 1.001 + 2;
+        if (fabs(ctx->box.p.v[i] - clip->p.v[i]) > clip->mat.v[i * 5] + r)
+            return false;
+    }
+    return true;
 }
 
 // Iter the program once.
-static int iter(gox_proc_t *proc, ctx_t *ctx)
+static int iter(expand_t *job, ctx_t *ctx)
 {
-    const float max_op_volume = 512 * 512 * 512;
+    gox_proc_t *proc = job->proc;
+    const proc_options_t *opts = &proc->run_options;
+    const float max_op_volume = opts->max_op_volume ?: 512 * 512 * 512;
     float v;
     int n, i;
     float volume, volume_tot = 0;
     ctx_t ctx2, *new_ctx;
-    node_t *expr, *rule;
+    node_t *expr;
 
+    if (ctx->instance) {
+        // Stamp the shapes of this generation, and go to the next one.
+        *add_op(job) = (shape_op_t){*ctx};
+        if (ctx->gen + 1 < ctx->instance->nb_gens) {
+            new_ctx = job_ctx_new(job);
+            *new_ctx = *ctx;
+            new_ctx->gen++;
+            DL_APPEND(job->ctxs, new_ctx);
+        }
+        return 0;
+    }
     if (ctx->life > 0) {
         ctx->life--;
         if (ctx->life <= 0)
             return 0;
     }
     if (ctx->wait > 0) {
-        new_ctx = calloc(1, sizeof(*new_ctx));
+        new_ctx = job_ctx_new(job);
         *new_ctx = *ctx;
         new_ctx->wait--;
-        DL_APPEND(proc->ctxs, new_ctx);
+        DL_APPEND(job->ctxs, new_ctx);
         return 0;
     }
 
@@ -471,28 +1456,33 @@ static int iter(gox_proc_t *proc, ctx_t *ctx)
             ctx2.prog = expr->children->next->next;
             for (i = 0; i < n; i++) {
                 simple_rand(&ctx2.seed);
-                new_ctx = calloc(1, sizeof(*new_ctx));
-                *new_ctx = ctx2;
-                if (expr->v) {
-                    new_ctx->vars[(int)expr->v - 1] = i;
+                if (!opts->clip.enabled || ctx_in_clip(proc, &ctx2)) {
+                    new_ctx = job_ctx_new(job);
+                    *new_ctx = ctx2;
+                    if (expr->v) {
+                        new_ctx->vars[(int)expr->v - 1] = i;
+                    }
+                    DL_APPEND(job->ctxs, new_ctx);
                 }
-                DL_APPEND(proc->ctxs, new_ctx);
                 TRY(apply_transf(proc, expr->children->next, &ctx2));
             }
         }
         if (expr->type == NODE_TRANSFB) {
-            new_ctx = calloc(1, sizeof(*new_ctx));
-            *new_ctx = *ctx;
-            new_ctx->prog = expr->children->next;
-            TRY(apply_transf(proc, expr->children, new_ctx));
-            DL_APPEND(proc->ctxs, new_ctx);
+            ctx2 = *ctx;
+            ctx2.prog = expr->children->next;
+            TRY(apply_transf(proc, expr->children, &ctx2));
+            if (!opts->clip.enabled || ctx_in_clip(proc, &ctx2)) {
+                new_ctx = job_ctx_new(job);
+                *new_ctx = ctx2;
+                DL_APPEND(job->ctxs, new_ctx);
+            }
         }
         if (expr->type == NODE_IF) {
             v = evaluate(expr->children, ctx);
             if (v) {
                 ctx2 = *ctx;
                 ctx2.prog = expr->children->next;
-                iter(proc, &ctx2);
+                iter(job, &ctx2);
             }
         }
         if (expr->type == NODE_SET) {
@@ -508,34 +1498,239 @@ static int iter(gox_proc_t *proc, ctx_t *ctx)
             simple_rand(&ctx->seed);
             ctx2 = *ctx;
             TRY(apply_transf(proc, expr->children, &ctx2));
-            // Is it a basic shape?
-            for (i = 0; i < ARRAY_SIZE(SHAPES); i++) {
-                if (str_equ(expr->id, SHAPES[i]->id)) {
-                    volume = box_get_volume(ctx2.box);
-                    if (volume > max_op_volume)
-                        return error(proc, expr, "abort: volume too big!");
-                    volume_tot += volume;
-                    call_shape(&ctx2, SHAPES[i]);
-                    break;
-                }
+            if (expr->shape) {
+                volume = box_get_volume(ctx2.box);
+                if (volume > max_op_volume)
+                    return expand_error(job, expr, "abort: volume too big!");
+                volume_tot += volume;
+                if (opts->clip.enabled && !in_clip(proc, &ctx2.box))
+                    continue;
+                emit_shape(job, &ctx2, expr->shape);
+                continue;
             }
-            if (i < ARRAY_SIZE(SHAPES)) continue;
-
             TRY(set_args(proc, expr->children->next, &ctx2));
-            rule = get_rule(proc->prog, expr->id, &ctx2);
-            if (!rule)
-                return error(proc, NULL, "Cannot find rule %s", expr->id);
-            ctx2.prog = rule;
-            new_ctx = calloc(1, sizeof(*new_ctx));
+            ctx2.prog = get_rule(expr->target, &ctx2);
+            if (opts->clip.enabled && !ctx_in_clip(proc, &ctx2))
+                continue;
+            new_ctx = job_ctx_new(job);
             *new_ctx = ctx2;
 
-            DL_APPEND(proc->ctxs, new_ctx);
+            DL_APPEND(job->ctxs, new_ctx);
+            if (can_instance(job, expr->target, new_ctx))
+                *add_op(job) = (shape_op_t){.call = new_ctx};
         }
     }
 end:
     return 0;
 }
 
+static void expand(int i, void *user)
+{
+    expand_t *job = (expand_t*)user + i;
+    job->r = iter(job, job->ctx);
+}
+
+/*
+ * Instances.
+ *
+ * A call to an invariant shape gives the same shapes for any integer
+ * translation of its box, so we voxelize them once in a template, with the
+ * box moved close to the origin, and then stamp the template at each call
+ * (see mesh_stamp).
+ *
+ * To get exactly the same result as the normal expansion, the call context
+ * stays in the queue, but it only stamps the shapes that the context would
+ * have emitted, and then re-queues itself in place of all the contexts it
+ * would have created, to stamp their shapes, and so on for each generation.
+ * Since the queue is first in first out, the contexts created at the same
+ * depth by a call always follow each other in the queue, so the shapes are
+ * stamped at the place they would have been emitted.
+ *
+ * The floating point errors of the transformations depend on the position,
+ * so at each call we still expand the shape, and we only use the template
+ * if we get exactly the same shapes.  This is a lot faster than the
+ * voxelization that we skip.
+ */
+
+// Max number of contexts we expand for an instance.  The bigger shapes are
+// run normally.
+#define TEMPLATE_MAX_ITERS 4096
+
+// Expand a context and all the contexts it creates, and put the emitted
+// shapes into the template, by generation.
+static int expand_all(gox_proc_t *proc, const ctx_t *ctx, template_t *tpl)
+{
+    expand_t job = {.proc = proc, .in_template = true};
+    ctx_t *c, *ctxs;
+    int i = 0, r = 0;
+
+    c = job_ctx_new(&job);
+    *c = *ctx;
+    DL_APPEND(job.ctxs, c);
+    while (job.ctxs && !r) {
+        ctxs = job.ctxs;
+        job.ctxs = NULL;
+        tpl->gens = realloc(tpl->gens, (tpl->nb_gens + 1) *
+                                       sizeof(*tpl->gens));
+        tpl->gens[tpl->nb_gens++] = (template_gen_t){.start = job.nb_ops};
+        while (ctxs && !r) {
+            if (i++ == TEMPLATE_MAX_ITERS) {
+                r = -1;
+                break;
+            }
+            c = ctxs;
+            DL_DELETE(ctxs, c);
+            r = iter(&job, c);
+            ctx_free(proc, c);
+        }
+        ctxs_free(proc, ctxs);
+        tpl->gens[tpl->nb_gens - 1].nb =
+            job.nb_ops - tpl->gens[tpl->nb_gens - 1].start;
+    }
+    job_ctxs_merge(proc, &job);
+    ctxs_free(proc, job.ctxs);
+    tpl->ops = job.ops;
+    tpl->nb_ops = job.nb_ops;
+    return r;
+}
+
+static void template_release(template_t *tpl)
+{
+    int i;
+    for (i = 0; i < tpl->nb_gens; i++)
+        mesh_delete(tpl->gens[i].mesh);
+    free(tpl->gens);
+    free(tpl->ops);
+    tpl->gens = NULL;
+    tpl->ops = NULL;
+    tpl->nb_gens = tpl->nb_ops = 0;
+}
+
+static void voxelize_gen(gox_proc_t *proc, template_t *tpl,
+                         template_gen_t *gen)
+{
+    mesh_op_batch_t *batch;
+    painter_t painter = proc->painter;
+    int i;
+
+    gen->mesh = mesh_new();
+    batch = mesh_op_batch_new();
+    for (i = gen->start; i < gen->start + gen->nb; i++) {
+        add_shape(batch, gen->mesh, &painter, &tpl->ops[i].ctx,
+                  tpl->ops[i].shape);
+    }
+    mesh_op_batch_delete(batch);
+    proc->stats.nb_ops += gen->nb;
+}
+
+// Test if a shape is exactly the shape of a template moved by an integer
+// offset.
+static bool same_shape(const shape_op_t *op, const shape_op_t *tpl_op,
+                       const vec3i_t *offset)
+{
+    const ctx_t *a = &op->ctx, *b = &tpl_op->ctx;
+    int i;
+    if (op->shape != tpl_op->shape || a->mode != b->mode ||
+        a->antialiased != b->antialiased ||
+        memcmp(&a->color, &b->color, sizeof(a->color)) ||
+        memcmp(a->box.mat.v, b->box.mat.v, 12 * sizeof(float)))
+        return false;
+    for (i = 0; i < 3; i++) {
+        if (a->box.p.v[i] != (double)b->box.p.v[i] + offset->v[i])
+            return false;
+    }
+    return true;
+}
+
+// Test if a call gives exactly the shapes of a template.
+static bool check_instance(gox_proc_t *proc, const ctx_t *ctx,
+                           const template_t *tpl, const vec3i_t *offset)
+{
+    template_t real = {};
+    bool ret;
+    int i;
+
+    ret = expand_all(proc, ctx, &real) == 0 &&
+          real.nb_gens == tpl->nb_gens && real.nb_ops == tpl->nb_ops;
+    for (i = 0; ret && i < real.nb_gens; i++)
+        ret = real.gens[i].nb == tpl->gens[i].nb;
+    for (i = 0; ret && i < real.nb_ops; i++)
+        ret = same_shape(&real.ops[i], &tpl->ops[i], offset);
+    template_release(&real);
+    return ret;
+}
+
+// Turn the queued context of an invariant shape call into an instance of
+// its template, if we get exactly the same shapes.
+static void call_instance(gox_proc_t *proc, ctx_t *ctx)
+{
+    template_t *tpl;
+    template_key_t key;
+    vec3i_t offset;
+    ctx_t ctx2 = *ctx;
+
+    offset = vec3i(floor(ctx->box.p.x), floor(ctx->box.p.y),
+                   floor(ctx->box.p.z));
+    ctx2.box.p.x -= offset.x;
+    ctx2.box.p.y -= offset.y;
+    ctx2.box.p.z -= offset.z;
+
+    memset(&key, 0, sizeof(key)); // Clear the padding.
+    key.prog = ctx2.prog;
+    key.box = ctx2.box;
+    key.color = ctx2.color;
+    memcpy(key.vars, ctx2.vars, sizeof(key.vars));
+    key.antialiased = ctx2.antialiased;
+    HASH_FIND(hh, proc->templates, &key, sizeof(key), tpl);
+    if (!tpl) {
+        tpl = calloc(1, sizeof(*tpl));
+        memcpy(&tpl->key, &key, sizeof(key));
+        if (expand_all(proc, &ctx2, tpl)) template_release(tpl);
+        HASH_ADD(hh, proc->templates, key, sizeof(tpl->key), tpl);
+    }
+    // Voxelizing a template only used once would be a waste.
+    if (++tpl->nb_calls < 2 || !tpl->nb_gens) return;
+    if (!check_instance(proc, ctx, tpl, &offset)) return;
+    ctx->instance = tpl;
+    ctx->offset = offset;
+    proc->stats.nb_instances++;
+}
+
+// Stamp the shapes of a generation of an instance, or if the stamp can't
+// give exactly the same voxels, run them normally.
+static void stamp_instance(gox_proc_t *proc, const ctx_t *ctx)
+{
+    template_t *tpl = ctx->instance;
+    template_gen_t *gen = &tpl->gens[ctx->gen];
+    ctx_t c;
+    int i;
+
+    if (!gen->nb) return;
+    if (!gen->mesh) voxelize_gen(proc, tpl, gen);
+    // Keep the order of the shapes already emitted in this frame.
+    if (proc->batch) mesh_op_batch_apply(proc->batch);
+    if (mesh_stamp(get_mesh(proc), gen->mesh, &ctx->offset)) return;
+    for (i = gen->start; i < gen->start + gen->nb; i++) {
+        // Exact, see same_shape.
+        c = tpl->ops[i].ctx;
+        c.box.p.x += ctx->offset.x;
+        c.box.p.y += ctx->offset.y;
+        c.box.p.z += ctx->offset.z;
+        call_shape(proc, &c, tpl->ops[i].shape);
+        proc->stats.nb_ops++;
+    }
+}
+
+static void templates_release(gox_proc_t *proc)
+{
+    template_t *tpl, *tmp;
+    HASH_ITER(hh, proc->templates, tpl, tmp) {
+        HASH_DEL(proc->templates, tpl);
+        template_release(tpl);
+        free(tpl);
+    }
+}
+
 // Defined in procedural.leg
 static node_t *parse(const char *txt, int *err_line);
 
@@ -549,17 +1744,30 @@ int proc_parse(const char *txt, gox_proc_t *proc)
         asprintf(&proc->error.str, "Parse error");
         return -1;
     }
+    if (compile(proc, proc->prog)) {
+        proc->state = PROC_PARSE_ERROR;
+        return -1;
+    }
+    set_invariant_shapes(proc->prog);
+    set_bounds(proc->prog);
     proc->state = PROC_READY;
     if (0) visit(proc->prog, 0);
     return 0;
 }
 
+static void thread_release(gox_proc_t *proc);
+
 void proc_release(gox_proc_t *proc)
 {
+    proc_stop(proc);
+    thread_release(proc);
     node_free(proc->prog);
     proc->prog = NULL;
-    ctxs_free(proc->ctxs);
     proc->ctxs = NULL;
+    ctx_pool_release(proc);
+    mesh_op_batch_delete(proc->batch);
+    proc->batch = NULL;
+    templates_release(proc);
     free(proc->error.str);
     proc->error.str = NULL;
     proc->error.line = 0;
@@ -569,15 +1777,28 @@ int proc_start(gox_proc_t *proc, const box_t *box)
 {
     // Reinit the context to a single ctx_t pointing at the main shape.
     ctx_t *ctx;
+    node_t *shape;
     assert(proc->state >= PROC_READY);
-    ctxs_free(proc->ctxs);
+    proc_stop(proc);
+    thread_release(proc);
+    ctxs_free(proc, proc->ctxs);
     proc->ctxs = NULL;
+    templates_release(proc);
     proc->frame = 0;
-    ctx = calloc(1, sizeof(*ctx));
+    proc->stats.peak_ctxs = 0;
+    proc->stats.nb_iters = 0;
+    proc->stats.nb_ops = 0;
+    proc->stats.nb_instances = 0;
+    proc->painter = goxel->painter;
+    proc->run_options = proc->options;
+    proc->painter.box = proc->run_options.clip.enabled ?
+                        &proc->run_options.clip.box : NULL;
+    ctx = ctx_new(proc);
     ctx->box = box ? *box : bbox_from_extents(vec3_zero, 0.5, 0.5, 0.5);
     ctx->color = vec4(0, 0, 1, 1);
     ctx->mode = MODE_OVER;
-    ctx->prog = get_rule(proc->prog, "main", ctx);
+    shape = find_shape(proc->prog, "main");
+    if (shape) ctx->prog = get_rule(shape, ctx);
     set_seed(rand(), &ctx->seed);
     DL_APPEND(proc->ctxs, ctx);
     if (!ctx->prog) return error(proc, NULL, "No 'main' shape");
@@ -587,20 +1808,36 @@ int proc_start(gox_proc_t *proc, const box_t *box)
 
 int proc_stop(gox_proc_t *proc)
 {
+#ifndef __EMSCRIPTEN__
+    proc_thread_t *t = proc->thread;
+    if (t && !t->joined) {
+        __atomic_store_n(&t->cancel, true, __ATOMIC_RELAXED);
+        pthread_join(t->thread, NULL);
+        t->joined = true;
+    }
+#endif
     proc->state = PROC_DONE;
     return 0;
 }
 
-int proc_iter(gox_proc_t *proc)
+// Max number of contexts expanded in parallel.
+#define EXPAND_MAX_CTXS 256
+
+// Run the program until the end of the frame, or until the deadline if
+// not zero.
+static int proc_iter_(gox_proc_t *proc, int64_t deadline)
 {
-    int r;
-    bool last;
+    PROFILED;
+    int i, k, n, r = 0;
+    bool last = false;
     ctx_t *ctx;
+    expand_t *jobs, *job;
+    shape_op_t *op;
 
     if (proc->state != PROC_RUNNING) return 0;
 
     if (!proc->ctxs) {
-        proc->state = PROC_DONE;
+        __atomic_store_n(&proc->state, PROC_DONE, __ATOMIC_RELEASE);
         return 0;
     }
 
@@ -612,32 +1849,172 @@ int proc_iter(gox_proc_t *proc)
         proc->ctxs->prev->last = true;
 
     proc->in_frame = false;
+    jobs = calloc(EXPAND_MAX_CTXS, sizeof(*jobs));
 
     while (true) {
-        ctx = proc->ctxs;
-        if (!ctx) {
-            proc->state = 2;
+        if (!proc->ctxs) {
+            __atomic_store_n(&proc->state, 2, __ATOMIC_RELEASE);
             break;
         }
-        DL_DELETE(proc->ctxs, ctx);
-        last = ctx->last;
-        ctx->last = false;
-        r = iter(proc, ctx);
-        free(ctx);
+        // Expand the next contexts of the frame in parallel.
+        for (n = 0; proc->ctxs && n < EXPAND_MAX_CTXS && !last; n++) {
+            ctx = proc->ctxs;
+            DL_DELETE(proc->ctxs, ctx);
+            last = ctx->last;
+            ctx->last = false;
+            jobs[n] = (expand_t){.proc = proc, .ctx = ctx};
+        }
+        parallel_for(n, expand, jobs);
+        proc->stats.nb_iters += n;
+
+        // Then merge the results in order, stopping at the first error.
+        for (i = 0; i < n; i++) {
+            job = &jobs[i];
+            job_ctxs_merge(proc, job);
+            if (r == 0) {
+                DL_CONCAT(proc->ctxs, job->ctxs);
+                for (k = 0; k < job->nb_ops; k++) {
+                    op = &job->ops[k];
+                    if (op->call) {
+                        call_instance(proc, op->call);
+                        continue;
+                    }
+                    if (op->ctx.instance) {
+                        stamp_instance(proc, &op->ctx);
+                        continue;
+                    }
+                    call_shape(proc, &op->ctx, op->shape);
+                    proc->stats.nb_ops++;
+                }
+                if (job->error.msg)
+                    error(proc, job->error.node, "%s", job->error.msg);
+                r = job->r;
+            } else {
+                ctxs_free(proc, job->ctxs);
+            }
+            free(job->ops);
+            ctx_free(proc, job->ctx);
+        }
         if (r != 0) {
-            proc->state = PROC_DONE;
+            __atomic_store_n(&proc->state, PROC_DONE, __ATOMIC_RELEASE);
             break;
         }
         if (last) break;
-        if (get_clock() - goxel->frame_clock > 16000000) {
+        if (proc->thread &&
+            __atomic_load_n(&proc->thread->cancel, __ATOMIC_RELAXED)) break;
+        if (deadline && get_clock() > deadline) {
             proc->in_frame = true;
-            return 0;
+            break;
         }
     }
-    proc->frame++;
+    free(jobs);
+    if (proc->batch) mesh_op_batch_apply(proc->batch);
+    if (!proc->in_frame) proc->frame++;
+    return 0;
+}
+
+int proc_iter(gox_proc_t *proc)
+{
+    return proc_iter_(proc, goxel->frame_clock + 16000000);
+}
+
+int proc_run(gox_proc_t *proc)
+{
+    while (proc->state == PROC_RUNNING)
+        proc_iter_(proc, 0);
+    return proc->error.str ? -1 : 0;
+}
+
+#ifndef __EMSCRIPTEN__
+
+static void thread_publish(proc_thread_t *t)
+{
+    mesh_t *snapshot = mesh_copy(t->mesh), *old;
+    while (__sync_lock_test_and_set(&t->lock, 1)) {}
+    old = t->snapshot;
+    t->snapshot = snapshot;
+    __sync_lock_release(&t->lock);
+    mesh_delete(old);
+}
+
+static void *thread_func(void *arg)
+{
+    gox_proc_t *proc = arg;
+    proc_thread_t *t = proc->thread;
+    int64_t next_publish = get_clock() + THREAD_PUBLISH_PERIOD;
+
+    while (proc->state == PROC_RUNNING &&
+           !__atomic_load_n(&t->cancel, __ATOMIC_RELAXED)) {
+        proc_iter_(proc, next_publish);
+        if (get_clock() < next_publish) continue;
+        thread_publish(t);
+        next_publish = get_clock() + THREAD_PUBLISH_PERIOD;
+    }
+    thread_publish(t);
+    __atomic_store_n(&t->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int proc_run_async(gox_proc_t *proc, const mesh_t *mesh)
+{
+    proc_thread_t *t;
+    assert(proc->state == PROC_RUNNING && !proc->thread);
+    t = calloc(1, sizeof(*t));
+    t->mesh = mesh_copy(mesh);
+    proc->thread = t;
+    if (pthread_create(&t->thread, NULL, thread_func, proc) != 0) {
+        LOG_E("Cannot create procedural thread");
+        mesh_delete(t->mesh);
+        free(t);
+        proc->thread = NULL;
+        return -1;
+    }
     return 0;
 }
 
+#else
+
+int proc_run_async(gox_proc_t *proc, const mesh_t *mesh)
+{
+    return -1;
+}
+
+#endif
+
+bool proc_sync(gox_proc_t *proc, mesh_t *mesh)
+{
+    proc_thread_t *t = proc->thread;
+    mesh_t *snapshot;
+    bool done;
+
+    if (!t) return false;
+    done = __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+    while (__sync_lock_test_and_set(&t->lock, 1)) {}
+    snapshot = t->snapshot;
+    t->snapshot = NULL;
+    __sync_lock_release(&t->lock);
+    if (snapshot && mesh) {
+        mesh_set(mesh, snapshot);
+        mesh->id = snapshot->id;
+    }
+    mesh_delete(snapshot);
+    if (done) thread_release(proc);
+    return snapshot && mesh;
+}
+
+static void thread_release(gox_proc_t *proc)
+{
+    proc_thread_t *t = proc->thread;
+    if (!t) return;
+#ifndef __EMSCRIPTEN__
+    if (!t->joined) pthread_join(t->thread, NULL);
+#endif
+    mesh_delete(t->mesh);
+    mesh_delete(t->snapshot);
+    free(t);
+    proc->thread = NULL;
+}
+
 static int list_saved_on_path(int i, const char *path, void *user_)
 {
    const char *data, *name;
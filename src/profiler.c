@@ -0,0 +1,277 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2017 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+static struct {
+    profiler_block_t *blocks;
+    int              lock;
+    int              frame;         // Number of ticks so far.
+    int64_t          last_tick;
+    int64_t          frame_time;
+    int64_t          history[PROFILER_HISTORY];
+} g_profiler = {};
+
+#define TRACE_MAX_EVENTS (1 << 19)
+
+typedef struct {
+    const char  *name;
+    const char  *cat;
+    int64_t     start;
+    int64_t     end;
+    int         tid;
+} trace_event_t;
+
+static struct {
+    bool            active;
+    int64_t         start;
+    trace_event_t   *events;    // Never freed, see profiler_trace_stop.
+    int             nb;
+    int             next_tid;
+} g_trace = {};
+
+// Small sequential thread ids, nicer to look at than the pthread ids.
+static int get_tid(void)
+{
+    static __thread int tid = 0;
+    if (!tid) tid = __sync_add_and_fetch(&g_trace.next_tid, 1);
+    return tid;
+}
+
+// Add a block to the sorted list the first time we use it.
+static void register_block(profiler_block_t *block)
+{
+    profiler_block_t **p;
+    while (__sync_lock_test_and_set(&g_profiler.lock, 1)) {}
+    if (!block->registered) {
+        for (p = &g_profiler.blocks; *p; p = &(*p)->next) {
+            if (strcmp((*p)->name, block->name) > 0) break;
+        }
+        block->next = *p;
+        __sync_synchronize();
+        *p = block;
+        block->registered = 1;
+    }
+    __sync_lock_release(&g_profiler.lock);
+}
+
+void profiler_leave_(profiler_scope_t *scope)
+{
+    profiler_block_t *block = scope->block;
+    int64_t end = get_clock();
+    if (!block->registered) register_block(block);
+    __sync_fetch_and_add(&block->time, end - scope->start);
+    __sync_fetch_and_add(&block->count, 1);
+    if (g_trace.active)
+        profiler_trace_event(block->name, "profiler", scope->start, end);
+}
+
+void profiler_tick(void)
+{
+    profiler_block_t *block;
+    int64_t t = get_clock();
+    int i = g_profiler.frame % PROFILER_HISTORY;
+
+    if (g_profiler.last_tick) {
+        g_profiler.frame_time = t - g_profiler.last_tick;
+        g_profiler.history[i] = g_profiler.frame_time;
+    }
+    g_profiler.last_tick = t;
+
+    for (block = g_profiler.blocks; block; block = block->next) {
+        block->frame_time = __sync_lock_test_and_set(&block->time, 0);
+        block->frame_count = __sync_lock_test_and_set(&block->count, 0);
+        block->avg_time = block->avg_time ?
+            block->avg_time * 0.95 + block->frame_time * 0.05 :
+            block->frame_time;
+        block->total_time += block->frame_time;
+        block->total_count += block->frame_count;
+        block->history[i] = block->frame_time;
+    }
+    g_profiler.frame++;
+}
+
+profiler_block_t *profiler_get_blocks(void)
+{
+    return g_profiler.blocks;
+}
+
+int64_t profiler_get_frame_time(void)
+{
+    return g_profiler.frame_time;
+}
+
+// Save the frames history as csv (one line per frame) or the summary and
+// history of each block as json, depending on the file extension.
+static void profiler_dump(const char *path)
+{
+    FILE *file;
+    profiler_block_t *block;
+    int f, i, nb, first;
+    bool json;
+
+    path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
+                    "csv\0*.csv\0json\0*.json\0", NULL, "profile.csv");
+    if (!path) return;
+    json = str_endswith(path, ".json");
+    file = fopen(path, "w");
+    if (!file) {
+        LOG_E("Cannot save to %s", path);
+        return;
+    }
+    nb = min(g_profiler.frame, PROFILER_HISTORY);
+    first = g_profiler.frame - nb;
+
+    if (!json) {
+        fprintf(file, "frame,frame_ms");
+        for (block = g_profiler.blocks; block; block = block->next)
+            fprintf(file, ",%s", block->name);
+        fprintf(file, "\n");
+        for (f = first; f < g_profiler.frame; f++) {
+            i = f % PROFILER_HISTORY;
+            fprintf(file, "%d,%.3f", f, g_profiler.history[i] / 1e6);
+            for (block = g_profiler.blocks; block; block = block->next)
+                fprintf(file, ",%.3f", block->history[i] / 1e6);
+            fprintf(file, "\n");
+        }
+        fclose(file);
+        return;
+    }
+
+    fprintf(file, "{\n  \"frames\": %d,\n  \"blocks\": [", g_profiler.frame);
+    for (block = g_profiler.blocks; block; block = block->next) {
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"calls\": %lld, "
+                "\"total_ms\": %.3f, \"avg_ms\": %.3f, \"history_ms\": [",
+                block == g_profiler.blocks ? "" : ",",
+                block->name, (long long)block->total_count,
+                block->total_time / 1e6, block->avg_time / 1e6);
+        for (f = first; f < g_profiler.frame; f++) {
+            fprintf(file, "%s%.3f", f == first ? "" : ", ",
+                    block->history[f % PROFILER_HISTORY] / 1e6);
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+}
+
+ACTION_REGISTER(profiler_dump,
+    .help = "Save the profiler timings as csv or json",
+    .cfunc = profiler_dump,
+    .csig = "vp",
+)
+
+void profiler_trace_event(const char *name, const char *cat,
+                          int64_t start, int64_t end)
+{
+    int i;
+    if (!g_trace.active) return;
+    i = __sync_fetch_and_add(&g_trace.nb, 1);
+    if (i >= TRACE_MAX_EVENTS) return;
+    g_trace.events[i] = (trace_event_t) {
+        .name = name,
+        .cat = cat,
+        .start = start,
+        .end = end,
+        .tid = get_tid(),
+    };
+}
+
+bool profiler_is_tracing(void)
+{
+    return g_trace.active;
+}
+
+void profiler_trace_start(void)
+{
+    if (g_trace.active) return;
+    if (!g_trace.events)
+        g_trace.events = calloc(TRACE_MAX_EVENTS, sizeof(*g_trace.events));
+    get_tid(); // So that the main thread gets the id 1.
+    g_trace.nb = 0;
+    g_trace.start = get_clock();
+    __sync_synchronize();
+    g_trace.active = true;
+    LOG_I("Start tracing");
+}
+
+int profiler_trace_stop(const char *path)
+{
+    FILE *file;
+    const trace_event_t *e;
+    int i, nb, tid;
+    char name[32];
+
+    if (!g_trace.active) return -1;
+    // Keep tracing if the dialog is cancelled or we can't open the file.
+    path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
+                    "json\0*.json\0", NULL, "trace.json");
+    if (!path) return -1;
+    file = fopen(path, "w");
+    if (!file) {
+        LOG_E("Cannot save to %s", path);
+        return -1;
+    }
+
+    g_trace.active = false;
+    __sync_synchronize();
+    // Another thread might still be adding an event, this is why we
+    // never free the events buffer.
+    nb = min(g_trace.nb, TRACE_MAX_EVENTS);
+    if (g_trace.nb > TRACE_MAX_EVENTS)
+        LOG_W("Trace buffer full, %d events lost",
+              g_trace.nb - TRACE_MAX_EVENTS);
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (tid = 1; tid <= g_trace.next_tid; tid++) {
+        if (tid == 1) sprintf(name, "main");
+        else sprintf(name, "worker %d", tid - 1);
+        fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}},\n",
+                tid, name);
+    }
+    for (i = 0; i < nb; i++) {
+        e = &g_trace.events[i];
+        fprintf(file, "{\"name\": \"%s\", \"cat\": \"%s\", "
+                "\"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                "\"pid\": 1, \"tid\": %d}%s\n",
+                e->name, e->cat, (e->start - g_trace.start) / 1e3,
+                (e->end - e->start) / 1e3, e->tid, i < nb - 1 ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    fclose(file);
+    LOG_I("Saved %d trace events to %s", nb, path);
+    return 0;
+}
+
+ACTION_REGISTER(trace_start,
+    .help = "Start recording a trace of all the operations",
+    .cfunc = profiler_trace_start,
+    .csig = "v",
+)
+
+static void trace_stop(const char *path)
+{
+    profiler_trace_stop(path);
+}
+
+ACTION_REGISTER(trace_stop,
+    .help = "Stop the trace and save it in the Chrome trace json format",
+    .cfunc = trace_stop,
+    .csig = "vp",
+)
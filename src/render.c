@@ -29,9 +29,9 @@
  * if we know that the block won't be used anymore.
  */
 
-// TODO: we need to get ride of unused blocks in the buffer, that hav not been
-// rendered for too long.  First we might need to keep track of how much video
-// memory is used, so we get an idea of how much we need that.
+// The blocks buffers are removed from the cache either when we reach the
+// memory budget (least recently used first), or when they have not been
+// rendered for ITEM_MAX_AGE frames.
 
 enum {
     ITEM_BLOCK,
@@ -43,6 +43,7 @@ enum {
 typedef struct {
     int id;
     int effects;
+    int lod;
 } block_item_key_t;
 
 struct render_item_t
@@ -64,8 +65,10 @@ struct render_item_t
     int             effects;
 
     GLuint      vertex_buffer;
+    GLuint      index_buffer;   // Only for the triangles.
     int         size;           // 4 (quads) or 3 (triangles).
-    int         nb_elements;    // Number of quads or triangle.
+    int         nb_elements;    // Number of quads or triangles indices.
+    int         last_frame;     // Last frame the block was rendered.
 };
 
 // The buffered item hash table.  For the moment it is only used of the blocks.
@@ -73,6 +76,16 @@ struct render_item_t
 
 // The cache of the g_items.
 static cache_t   *g_items_cache;
+// Default memory budget of the cache, can be changed at runtime with
+// render_set_cache_size.
+static const int64_t ITEM_CACHE_SIZE = 1 * GB;
+// Number of frames after which we remove unused blocks from the cache.
+static const int ITEM_MAX_AGE = 600;
+static struct {
+    render_cache_stats_t stats;
+    int evictions;  // Evictions of the current frame.
+    int frame;      // Frame of the last call to cache_iter.
+} g_cache = {};
 static const int BATCH_QUAD_COUNT = 1 << 14;
 static model3d_t *g_cube_model;
 static model3d_t *g_line_model;
@@ -85,8 +98,6 @@ static model3d_t *g_wire_rect_model;
 // All the shaders code is at the bottom of the file.
 static const char *VSHADER;
 static const char *FSHADER;
-static const char *POS_DATA_VSHADER;
-static const char *POS_DATA_FSHADER;
 static const char *SHADOW_MAP_VSHADER;
 static const char *SHADOW_MAP_FSHADER;
 
@@ -127,6 +138,14 @@ static GLuint g_bump_tex;
 static GLuint g_shadow_map_fbo;
 static texture_t *g_shadow_map; // XXX: the fbo should be part of the tex.
 
+// Keep track of what is currently in the shadow map, so that we only
+// render it again when the meshes or the light change.
+static struct {
+    uint64_t key;       // Hash of the rendered meshes ids and effects.
+    vec3_t   light_dir;
+    mat4_t   mvp;
+} g_shadow_map_state = {};
+
 #define OFFSET(n) offsetof(voxel_vertex_t, n)
 
 // The list of all the attributes used by the shaders.
@@ -140,7 +159,6 @@ static const struct {
     {"a_pos",           3, GL_BYTE,            false, OFFSET(pos)},
     {"a_normal",        3, GL_BYTE,            false, OFFSET(normal)},
     {"a_color",         4, GL_UNSIGNED_BYTE,   true,  OFFSET(color)},
-    {"a_pos_data",      4, GL_UNSIGNED_BYTE,   true,  OFFSET(pos_data)},
     {"a_uv",            2, GL_UNSIGNED_BYTE,   true,  OFFSET(uv)},
     {"a_bump_uv",       2, GL_UNSIGNED_BYTE,   false, OFFSET(bump_uv)},
     {"a_bshadow_uv",    2, GL_UNSIGNED_BYTE,   false, OFFSET(bshadow_uv)},
@@ -167,7 +185,7 @@ static const struct {
  *
  */
 
-static float get_border_dist(float x, float y, int mask)
+float render_get_border_dist(float x, float y, int mask)
 {
     const vec2_t corners[4] = {
         vec2(0, 0), vec2(1, 0), vec2(1, 1), vec2(0, 1)};
@@ -194,7 +212,7 @@ static void init_border_texture(void)
         for (y = 0; y < s; y++) for (x = 0; x < s; x++) {
             ay = mask / 16 * s + y;
             ax = mask % 16 * s + x;
-            data[ay * s * 16 + ax] = 255 * get_border_dist(
+            data[ay * s * 16 + ax] = 255 * render_get_border_dist(
                     (float)x / s + 0.5 / s, (float)y / s + 0.5 / s, mask);
         }
     }
@@ -344,8 +362,7 @@ void render_init()
     init_border_texture();
     init_bump_texture();
 
-    // XXX: pick the proper memory size according to what is available.
-    g_items_cache = cache_create(1 * GB);
+    g_items_cache = cache_create(ITEM_CACHE_SIZE);
     g_cube_model = model3d_cube();
     g_line_model = model3d_line();
     g_wire_cube_model = model3d_wire_cube();
@@ -367,29 +384,123 @@ void render_deinit(void)
     index_buffer = 0;
 }
 
+// Bump allocator for the items of the rendering queue.  The queued items
+// only live until the end of the frame, so instead of a calloc and free
+// for each of them we take them from a list of chunks that we reuse at
+// each frame (see render_new_frame).
+#define FRAME_CHUNK_SIZE (64 * 1024)
+typedef struct frame_chunk frame_chunk_t;
+struct frame_chunk {
+    frame_chunk_t   *next;
+    int             used;
+    char            data[FRAME_CHUNK_SIZE] __attribute__((aligned(16)));
+};
+static struct {
+    frame_chunk_t   *chunks;
+    frame_chunk_t   *current;
+} g_frame_arena = {};
+
+static void *frame_alloc(int size)
+{
+    frame_chunk_t *chunk = g_frame_arena.current;
+    void *ret;
+
+    size = (size + 15) & ~15;
+    assert(size <= FRAME_CHUNK_SIZE);
+    if (!chunk || chunk->used + size > FRAME_CHUNK_SIZE) {
+        chunk = chunk ? chunk->next : g_frame_arena.chunks;
+        if (!chunk) {
+            chunk = calloc(1, sizeof(*chunk));
+            LL_APPEND(g_frame_arena.chunks, chunk);
+        }
+        g_frame_arena.current = chunk;
+    }
+    ret = chunk->data + chunk->used;
+    chunk->used += size;
+    memset(ret, 0, size);
+    return ret;
+}
+
+// Release what a queued item holds.  The item memory itself belongs to the
+// frame arena.
+static void item_release(render_item_t *item)
+{
+    if (item->type == ITEM_MESH) mesh_delete(item->mesh);
+    texture_delete(item->tex);
+}
+
+void render_new_frame(renderer_t *rend)
+{
+    frame_chunk_t *chunk;
+    render_item_t *item, *tmp;
+
+    // Items that have been queued but never rendered.
+    DL_FOREACH_SAFE(rend->items, item, tmp) {
+        DL_DELETE(rend->items, item);
+        item_release(item);
+    }
+    LL_FOREACH(g_frame_arena.chunks, chunk) chunk->used = 0;
+    g_frame_arena.current = g_frame_arena.chunks;
+}
+
 // A global buffer large enough to contain all the vertices for any block.
 static voxel_vertex_t* g_vertices_buffer = NULL;
+// Same thing for the marching cube indices.
+static uint16_t *g_indices_buffer = NULL;
 
 // Used for the cache.
 static int item_delete(void *item_)
 {
     render_item_t *item = item_;
     GL(glDeleteBuffers(1, &item->vertex_buffer));
+    if (item->index_buffer) GL(glDeleteBuffers(1, &item->index_buffer));
     free(item);
+    g_cache.stats.nb_items--;
+    g_cache.evictions++;
     return 0;
 }
 
-static render_item_t *get_item_for_block(const block_t *block, int effects)
+static bool item_expired(void *item_, void *user)
+{
+    const render_item_t *item = item_;
+    return goxel->frame_count - item->last_frame > ITEM_MAX_AGE;
+}
+
+// Called at each render, but only does something once per frame.
+static void cache_iter(void)
+{
+    if (g_cache.frame == goxel->frame_count) return;
+    g_cache.frame = goxel->frame_count;
+    cache_evict(g_items_cache, item_expired, NULL);
+    g_cache.stats.evictions = g_cache.evictions;
+    g_cache.evictions = 0;
+}
+
+void render_set_cache_size(int64_t size)
+{
+    cache_set_max_size(g_items_cache, size);
+}
+
+void render_get_cache_stats(render_cache_stats_t *stats)
+{
+    *stats = g_cache.stats;
+    stats->size = cache_get_size(g_items_cache);
+}
+
+static render_item_t *get_item_for_block(const block_t *block, int effects,
+                                         int lod)
 {
     render_item_t *item;
+    int nb_vertices, size;
     const int effects_mask = EFFECT_BORDERS | EFFECT_BORDERS_ALL |
                              EFFECT_MARCHING_CUBES | EFFECT_SMOOTH |
-                             EFFECT_FLAT;
+                             EFFECT_FLAT | EFFECT_SURFACE_NETS;
     // For the moment we always compute the smooth normal no mater what.
     effects |= EFFECT_SMOOTH;
     block_item_key_t key = {
         .id = block->data->id,
         .effects = effects & effects_mask,
+        .lod = lod,
     };
 
     item = cache_get(g_items_cache, &key, sizeof(key));
@@ -403,33 +514,68 @@ static render_item_t *get_item_for_block(const block_t *block, int effects)
         g_vertices_buffer = calloc(
                 BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4,
                 sizeof(*g_vertices_buffer));
-    item->nb_elements = block_generate_vertices(block->data, effects,
-                                                block->id, g_vertices_buffer);
-    item->size = (effects & EFFECT_MARCHING_CUBES) ? 3 : 4;
-    if (item->nb_elements > BATCH_QUAD_COUNT) {
-        LOG_W("Too many quads!");
-        item->nb_elements = BATCH_QUAD_COUNT;
+    if (!g_indices_buffer && (effects & EFFECT_SMOOTH_MESH))
+        g_indices_buffer = calloc(BLOCK_MC_MAX_INDICES,
+                                  sizeof(*g_indices_buffer));
+    if (effects & EFFECT_SURFACE_NETS) {
+        PROFILED2("block_generate_vertices_sn");
+        item->size = 3;
+        nb_vertices = block_generate_vertices_sn(
+                block->data, effects, g_vertices_buffer,
+                g_indices_buffer, &item->nb_elements);
+    } else if (effects & EFFECT_MARCHING_CUBES) {
+        PROFILED2("block_generate_vertices_mc");
+        item->size = 3;
+        nb_vertices = block_generate_vertices_mc(
+                block->data, effects, g_vertices_buffer,
+                g_indices_buffer, &item->nb_elements);
+    } else {
+        PROFILED2("block_generate_vertices");
+        item->size = 4;
+        if (lod)
+            item->nb_elements = block_generate_vertices_lod(
+                    block->data, lod, g_vertices_buffer);
+        else
+            item->nb_elements = block_generate_vertices(
+                    block->data, effects, g_vertices_buffer);
+        if (item->nb_elements > BATCH_QUAD_COUNT) {
+            LOG_W("Too many quads!");
+            item->nb_elements = BATCH_QUAD_COUNT;
+        }
+        nb_vertices = item->nb_elements * 4;
     }
+    size = nb_vertices * sizeof(*g_vertices_buffer);
     if (item->nb_elements != 0) {
-        GL(glBufferData(GL_ARRAY_BUFFER,
-                item->nb_elements * item->size * sizeof(*g_vertices_buffer),
-                g_vertices_buffer, GL_STATIC_DRAW));
+        PROFILED2("upload_vertices");
+        GL(glBufferData(GL_ARRAY_BUFFER, size, g_vertices_buffer,
+                        GL_STATIC_DRAW));
+        if (item->size == 3) {
+            GL(glGenBuffers(1, &item->index_buffer));
+            GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, item->index_buffer));
+            GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                            item->nb_elements * sizeof(*g_indices_buffer),
+                            g_indices_buffer, GL_STATIC_DRAW));
+            size += item->nb_elements * sizeof(*g_indices_buffer);
+        }
     }
 
-    cache_add(g_items_cache, &key, sizeof(key), item,
-              item->nb_elements * item->size * sizeof(*g_vertices_buffer),
+    // The cost is the size of the buffers in bytes, plus the item itself
+    // so that empty blocks also count.
+    g_cache.stats.nb_items++;
+    cache_add(g_items_cache, &key, sizeof(key), item, size + sizeof(*item),
               item_delete);
     return item;
 }
 
 static void render_block_(renderer_t *rend, block_t *block, int effects,
-                          prog_t *prog, mat4_t *model)
+                          int lod, prog_t *prog, mat4_t *model)
 {
     render_item_t *item;
     mat4_t block_model;
     int attr;
 
-    item = get_item_for_block(block, effects);
+    item = get_item_for_block(block, effects, lod);
+    item->last_frame = goxel->frame_count;
     if (item->nb_elements == 0) return;
     GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
 
@@ -453,7 +599,10 @@ static void render_block_(renderer_t *rend, block_t *block, int effects,
         GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
                           GL_UNSIGNED_SHORT, 0));
     } else {
-        GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
+        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, item->index_buffer));
+        GL(glDrawElements(GL_TRIANGLES, item->nb_elements,
+                          GL_UNSIGNED_SHORT, 0));
+        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer));
     }
 }
 
@@ -485,6 +634,9 @@ vec3_t render_get_light_dir(const renderer_t *rend)
 }
 
 // Compute the minimum projection box to use for the shadow map.
+// Since the projection is linear, the bounds of a block are the bounds of
+// its center plus the bounds of the corners of a block centered at the
+// origin, so we only need to transform one point per block.
 static void compute_shadow_map_box(
                 const renderer_t *rend,
                 float rect[6])
@@ -505,46 +657,77 @@ static void compute_shadow_map_box(
     block_t *block;
     vec3_t p;
     int i;
+    float ext[6] = {NAN, NAN, NAN, NAN, NAN, NAN};
     mat4_t view_mat = mat4_lookat(get_light_dir(rend, false),
                                   vec3(0, 0, 0), vec3(0, 1, 0));
     for (i = 0; i < 6; i++)
         rect[i] = NAN;
 
+    for (i = 0; i < 8; i++) {
+        p = mat4_mul_vec(view_mat, vec4(POS[i].x * N, POS[i].y * N,
+                                        POS[i].z * N, 0)).xyz;
+        ext[0] = min(ext[0], p.x);
+        ext[1] = max(ext[1], p.x);
+        ext[2] = min(ext[2], p.y);
+        ext[3] = max(ext[3], p.y);
+        ext[4] = min(ext[4], -p.z);
+        ext[5] = max(ext[5], -p.z);
+    }
+
     DL_FOREACH(rend->items, item) {
         if (item->type != ITEM_MESH) continue;
         MESH_ITER_BLOCKS(item->mesh, block) {
-            for (i = 0; i < 8; i++) {
-                p = vec3(block->pos.x, block->pos.y, block->pos.z);
-                p = vec3_addk(p, POS[i], N);
-                p = mat4_mul_vec3(view_mat, p);
-                rect[0] = min(rect[0], p.x);
-                rect[1] = max(rect[1], p.x);
-                rect[2] = min(rect[2], p.y);
-                rect[3] = max(rect[3], p.y);
-                rect[4] = min(rect[4], -p.z);
-                rect[5] = max(rect[5], -p.z);
-            }
+            p = vec3(block->pos.x, block->pos.y, block->pos.z);
+            p = mat4_mul_vec3(view_mat, p);
+            rect[0] = min(rect[0], p.x + ext[0]);
+            rect[1] = max(rect[1], p.x + ext[1]);
+            rect[2] = min(rect[2], p.y + ext[2]);
+            rect[3] = max(rect[3], p.y + ext[3]);
+            rect[4] = min(rect[4], -p.z + ext[4]);
+            rect[5] = max(rect[5], -p.z + ext[5]);
         }
     }
 }
 
+/*
+ * Pick the LOD level of a block from the size of its voxels on screen.
+ *  vp:      view projection matrix.
+ *  k:       number of pixels per unit at a distance of one.
+ */
+static int get_block_lod(const renderer_t *rend, const block_t *block,
+                         const mat4_t *vp, float k)
+{
+    vec4_t p;
+    float d, size;
+    int lod = 0;
+
+    p = mat4_mul_vec(*vp, vec4(block->pos.x, block->pos.y, block->pos.z, 1));
+    // Use the distance of the nearest point of the block.  With an ortho
+    // projection w is always 1.
+    d = rend->proj_mat.v[11] ? p.w - BLOCK_SIZE * 0.87 : 1;
+    if (d <= 0) return 0;
+    size = k / d;
+    while (lod < BLOCK_LOD_MAX && size * (1 << lod) < rend->settings.lod)
+        lod++;
+    return lod;
+}
+
 static void render_mesh_(renderer_t *rend, mesh_t *mesh, int effects,
-                         const mat4_t *shadow_mvp)
+                         const int rect[4], const mat4_t *shadow_mvp)
 {
+    PROFILED;
     prog_t *prog;
     block_t *block;
-    mat4_t model = mat4_identity;
-    int attr;
-    float pos_scale = 1.0f;
+    mat4_t model = mat4_identity, vp = mat4_identity;
+    int attr, lod = 0;
+    float pos_scale = 1.0f, lod_k = 0;
     vec3_t light_dir = get_light_dir(rend, true);
-    bool shadow = false;
+    bool shadow = false, cull;
 
-    if (effects & EFFECT_MARCHING_CUBES)
+    if (effects & EFFECT_SMOOTH_MESH)
         pos_scale = 1.0 / MC_VOXEL_SUB_POS;
 
-    if (effects & EFFECT_RENDER_POS)
-        prog = get_prog(POS_DATA_VSHADER, POS_DATA_FSHADER, NULL);
-    else if (effects & EFFECT_SHADOW_MAP)
+    if (effects & EFFECT_SHADOW_MAP)
         prog = get_prog(SHADOW_MAP_VSHADER, SHADOW_MAP_FSHADER, NULL);
     else {
         shadow = rend->settings.shadow;
@@ -602,8 +785,20 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh, int effects,
 
     GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer));
 
+    // No LOD for the smooth meshes or the shadow map.
+    if (rect && rend->settings.lod > 0 && !(effects & EFFECT_SMOOTH_MESH)) {
+        vp = mat4_mul(rend->proj_mat, rend->view_mat);
+        lod_k = rend->proj_mat.v[5] * rect[3] / 2;
+    }
+
+    // The blocks fully enclosed by their neighbors can't be seen, unless
+    // we render the back faces.
+    cull = !(effects & (EFFECT_SEE_BACK | EFFECT_SEMI_TRANSPARENT));
+
     MESH_ITER_BLOCKS(mesh, block) {
-        render_block_(rend, block, effects, prog, &model);
+        if (cull && block_is_hidden(block)) continue;
+        if (lod_k) lod = get_block_lod(rend, block, &vp, lod_k);
+        render_block_(rend, block, effects, lod, prog, &model);
     }
 
     for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
@@ -612,20 +807,16 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh, int effects,
     if (effects & EFFECT_SEE_BACK) {
         effects &= ~EFFECT_SEE_BACK;
         effects |= EFFECT_SEMI_TRANSPARENT;
-        render_mesh_(rend, mesh, effects, shadow_mvp);
+        render_mesh_(rend, mesh, effects, rect, shadow_mvp);
     }
 }
 
 void render_mesh(renderer_t *rend, const mesh_t *mesh, int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_alloc(sizeof(*item));
     item->type = ITEM_MESH;
     item->mesh = mesh_copy(mesh);
     item->effects = effects | rend->settings.effects;
-    // With EFFECT_RENDER_POS we need to remove some effects.
-    if (item->effects & EFFECT_RENDER_POS)
-        item->effects &= ~(EFFECT_SEMI_TRANSPARENT | EFFECT_SEE_BACK |
-                           EFFECT_MARCHING_CUBES);
     DL_APPEND(rend->items, item);
 }
 
@@ -674,7 +865,7 @@ static void render_grid_item(renderer_t *rend, const render_item_t *item)
 void render_plane(renderer_t *rend, const plane_t *plane,
                   const uvec4b_t *color)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_alloc(sizeof(*item));
     item->type = ITEM_GRID;
     item->mat = plane->mat;
     mat4_itranslate(&item->mat, 0.5, 0.5, 0);
@@ -687,7 +878,7 @@ void render_plane(renderer_t *rend, const plane_t *plane,
 void render_img(renderer_t *rend, texture_t *tex, const mat4_t *mat,
                 int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_alloc(sizeof(*item));
     item->type = ITEM_MODEL3D;
     item->mat = mat ? *mat : mat4_identity;
     item->proj_screen = !mat;
@@ -700,7 +891,7 @@ void render_img(renderer_t *rend, texture_t *tex, const mat4_t *mat,
 
 void render_rect(renderer_t *rend, const plane_t *plane, int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_alloc(sizeof(*item));
     assert((effects & EFFECT_STRIP) == effects);
     item->type = ITEM_MODEL3D;
     item->mat = plane->mat;
@@ -724,7 +915,7 @@ static plane_t line_create_plane(const vec3_t *a, const vec3_t *b)
 void render_line(renderer_t *rend, const vec3_t *a, const vec3_t *b,
                  const uvec4b_t *color)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_alloc(sizeof(*item));
     item->type = ITEM_MODEL3D;
     item->model3d = g_line_model;
     item->mat = line_create_plane(a, b).mat;
@@ -736,7 +927,7 @@ void render_line(renderer_t *rend, const vec3_t *a, const vec3_t *b,
 void render_box(renderer_t *rend, const box_t *box,
                 const uvec4b_t *color, int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_alloc(sizeof(*item));
     assert((effects & (EFFECT_STRIP | EFFECT_WIREFRAME | EFFECT_SEE_BACK)) \
             == effects);
     item->type = ITEM_MODEL3D;
@@ -750,7 +941,7 @@ void render_box(renderer_t *rend, const box_t *box,
 
 void render_sphere(renderer_t *rend, const mat4_t *mat)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_alloc(sizeof(*item));
     item->type = ITEM_MODEL3D;
     item->mat = *mat;
     item->model3d = g_sphere_model;
@@ -774,11 +965,34 @@ static int item_sort_cmp(const render_item_t *a, const render_item_t *b)
 }
 
 
+// Compute a key that changes when any of the meshes that cast shadows
+// changes.
+static uint64_t get_shadow_map_key(const renderer_t *rend)
+{
+    render_item_t *item;
+    uint64_t key = 14695981039346656037ULL;
+    DL_FOREACH(rend->items, item) {
+        if (item->type != ITEM_MESH) continue;
+        key = (key ^ item->mesh->id) * 1099511628211ULL;
+        key = (key ^ (item->effects & EFFECT_SMOOTH_MESH)) *
+              1099511628211ULL;
+    }
+    return key;
+}
+
 static mat4_t render_shadow_map(renderer_t *rend)
 {
+    PROFILED;
     render_item_t *item;
     float rect[6];
     int effects;
+    uint64_t key = get_shadow_map_key(rend);
+    vec3_t light_dir = get_light_dir(rend, false);
+
+    if (g_shadow_map_fbo && key == g_shadow_map_state.key &&
+            vec3_equal(light_dir, g_shadow_map_state.light_dir))
+        return g_shadow_map_state.mvp;
+
     // Create a renderer looking at the scene from the light.
     compute_shadow_map_box(rend, rect);
     mat4_t bias_mat = mat4(0.5, 0.0, 0.0, 0.0,
@@ -819,25 +1033,30 @@ static mat4_t render_shadow_map(renderer_t *rend)
 
     DL_FOREACH(rend->items, item) {
         if (item->type == ITEM_MESH) {
-            effects = (item->effects & EFFECT_MARCHING_CUBES);
+            effects = (item->effects & EFFECT_SMOOTH_MESH);
             effects |= EFFECT_SHADOW_MAP;
-            render_mesh_(&srend, item->mesh, effects, NULL);
+            render_mesh_(&srend, item->mesh, effects, NULL, NULL);
         }
     }
 
     mat4_t ret = bias_mat;
     mat4_imul(&ret, proj_mat);
     mat4_imul(&ret, view_mat);
+    g_shadow_map_state.key = key;
+    g_shadow_map_state.light_dir = light_dir;
+    g_shadow_map_state.mvp = ret;
     return ret;
 }
 void render_render(renderer_t *rend, const int rect[4],
                    const vec4_t *clear_color)
 {
+    PROFILED;
     render_item_t *item, *tmp;
     mat4_t shadow_mvp;
     bool shadow = rend->settings.shadow &&
-        !(rend->settings.effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP));
+        !(rend->settings.effects & EFFECT_SHADOW_MAP);
 
+    cache_iter();
     if (shadow) {
         GL(glDisable(GL_SCISSOR_TEST));
         shadow_mvp = render_shadow_map(rend);
@@ -859,21 +1078,17 @@ void render_render(renderer_t *rend, const int rect[4],
     DL_FOREACH_SAFE(rend->items, item, tmp) {
         switch (item->type) {
         case ITEM_MESH:
-            render_mesh_(rend, item->mesh, item->effects, &shadow_mvp);
-            DL_DELETE(rend->items, item);
-            mesh_delete(item->mesh);
+            render_mesh_(rend, item->mesh, item->effects, rect, &shadow_mvp);
             break;
         case ITEM_MODEL3D:
             render_model_item(rend, item);
-            DL_DELETE(rend->items, item);
             break;
         case ITEM_GRID:
             render_grid_item(rend, item);
-            DL_DELETE(rend->items, item);
             break;
         }
-        texture_delete(item->tex);
-        free(item);
+        DL_DELETE(rend->items, item);
+        item_release(item);
     }
     assert(rend->items == NULL);
 }
@@ -891,6 +1106,7 @@ int render_get_default_settings(int i, char **name, render_settings_t *out)
         .smoothness = 0.0,
         .effects = EFFECT_BORDERS,
         .shadow = 0.3,
+        .lod = 1,
     };
     switch (i) {
         case 0:
@@ -1069,36 +1285,6 @@ static const char *FSHADER =
     "}                                                                  \n"
 ;
 
-static const char *POS_DATA_VSHADER =
-    "                                                                   \n"
-    "attribute vec3 a_pos;                                              \n"
-    "attribute vec4 a_pos_data;                                         \n"
-    "uniform   mat4 u_model;                                            \n"
-    "uniform   mat4 u_view;                                             \n"
-    "uniform   mat4 u_proj;                                             \n"
-    "varying   vec4 v_pos_data;                                         \n"
-    "void main()                                                        \n"
-    "{                                                                  \n"
-    "    vec3 pos = a_pos;                                              \n"
-    "    gl_Position = u_proj * u_view * u_model * vec4(pos, 1.0);      \n"
-    "    v_pos_data = a_pos_data;                                       \n"
-    "}                                                                  \n"
-;
-
-static const char *POS_DATA_FSHADER =
-    "                                                                 \n"
-    "#ifdef GL_ES                                                     \n"
-    "precision highp float;                                           \n"
-    "#endif                                                           \n"
-    "                                                                 \n"
-    "varying lowp vec4 v_pos_data;                                    \n"
-    "                                                                 \n"
-    "void main()                                                      \n"
-    "{                                                                \n"
-    "    gl_FragColor = v_pos_data;                                   \n"
-    "}                                                                \n"
-;
-
 static const char *SHADOW_MAP_VSHADER =
     "                                                                   \n"
     "attribute vec3 a_pos;                                              \n"
@@ -0,0 +1,408 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2017 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+/*
+ * Software renderer, used when we don't have an OpenGL context, like when
+ * we export an image from the command line.
+ *
+ * It only renders the cubes (no marching cubes), and tries to look like the
+ * VSHADER / FSHADER shaders of render.c: ambient, diffuse and specular
+ * light, border shadows and bumps.  Instead of a shadow map we cast a ray
+ * toward the light.
+ *
+ * We first generate the quads of all the blocks in parallel, then put them
+ * into screen tiles bins, and finally render the tiles in parallel.  For
+ * each pixel we only keep the closest quad in a first pass, so that we
+ * shade each pixel only once.
+ */
+
+#define TILE_SIZE 64
+
+typedef struct {
+    vec3_t  win;    // Window coordinates, with y going up, and the depth.
+    float   iw;     // 1 / w, for perspective correct interpolation.
+    vec3_t  pos;    // World position.
+    vec3_t  normal;
+    vec2_t  uv;
+} sr_vertex_t;
+
+typedef struct {
+    sr_vertex_t v[4];
+    vec3_t      color;
+    int         face;
+    int         shadow_mask;
+    int         borders_mask;
+} sr_quad_t;
+
+typedef struct {
+    int *quads;
+    int nb;
+    int allocated;
+} sr_bin_t;
+
+typedef struct {
+    const renderer_t *rend;
+    const mesh_t *mesh;
+    int w, h;
+    int effects;
+    mat4_t mvp;
+    vec3_t eye;
+    vec3_t light_dir;
+    int bounds[2][3];   // Bounding voxels of the mesh, for the ray casts.
+
+    block_t **blocks;
+    sr_quad_t **blocks_quads;
+    int *blocks_nb_quads;
+
+    sr_quad_t *quads;
+    int nb_quads;
+
+    int nb_tiles[2];
+    sr_bin_t *bins;
+    uint8_t *out;
+} sr_ctx_t;
+
+// Triangles of a quad, like the GL index buffer.
+static const int QUAD_TRIS[2][3] = {{0, 1, 2}, {2, 3, 0}};
+
+static void generate_block_quads(int i, void *user)
+{
+    sr_ctx_t *ctx = user;
+    const block_t *block = ctx->blocks[i];
+    voxel_vertex_t *verts;
+    sr_quad_t *quads, *quad;
+    sr_vertex_t *v;
+    vec4_t p;
+    int nb, q, k, r = 0;
+    const int ts = VOXEL_TEXTURE_SIZE;
+
+    verts = malloc(BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4 *
+                   sizeof(*verts));
+    nb = block_generate_vertices(block->data, ctx->effects, verts);
+    quads = calloc(nb, sizeof(*quads));
+    for (q = 0; q < nb; q++) {
+        quad = &quads[r];
+        for (k = 0; k < 4; k++) {
+            v = &quad->v[k];
+            v->pos = vec3(block->pos.x + verts[q * 4 + k].pos.x - 8,
+                          block->pos.y + verts[q * 4 + k].pos.y - 8,
+                          block->pos.z + verts[q * 4 + k].pos.z - 8);
+            p = mat4_mul_vec(ctx->mvp,
+                             vec4(v->pos.x, v->pos.y, v->pos.z, 1));
+            // We don't clip the triangles, so just ignore the quads that
+            // go behind the camera.
+            if (p.w <= 0.0001) break;
+            v->iw = 1 / p.w;
+            v->win = vec3((p.x * v->iw * 0.5 + 0.5) * ctx->w,
+                          (p.y * v->iw * 0.5 + 0.5) * ctx->h,
+                          p.z * v->iw * 0.5 + 0.5);
+            v->normal = vec3(verts[q * 4 + k].normal.x,
+                             verts[q * 4 + k].normal.y,
+                             verts[q * 4 + k].normal.z);
+            v->uv = vec2(verts[q * 4 + k].uv.x / 255.,
+                         verts[q * 4 + k].uv.y / 255.);
+        }
+        if (k < 4) continue;
+        quad->color = vec3(verts[q * 4].color.r / 255.,
+                           verts[q * 4].color.g / 255.,
+                           verts[q * 4].color.b / 255.);
+        // Get back the masks from the textures coordinates.
+        quad->shadow_mask = verts[q * 4].bshadow_uv.x / ts +
+                            verts[q * 4].bshadow_uv.y / ts * 16;
+        quad->borders_mask = verts[q * 4].bump_uv.x / 16;
+        quad->face = verts[q * 4].bump_uv.y / 16;
+        r++;
+    }
+    free(verts);
+    ctx->blocks_quads[i] = quads;
+    ctx->blocks_nb_quads[i] = r;
+}
+
+static void bin_add(sr_bin_t *bin, int quad)
+{
+    if (bin->nb >= bin->allocated) {
+        bin->allocated = max(64, bin->allocated * 2);
+        bin->quads = realloc(bin->quads, bin->allocated * sizeof(int));
+    }
+    bin->quads[bin->nb++] = quad;
+}
+
+static void bin_quads(sr_ctx_t *ctx)
+{
+    int i, k, x, y, tx0, tx1, ty0, ty1;
+    float xmin, xmax, ymin, ymax;
+    const sr_quad_t *quad;
+
+    for (i = 0; i < ctx->nb_quads; i++) {
+        quad = &ctx->quads[i];
+        xmin = ymin = +INFINITY;
+        xmax = ymax = -INFINITY;
+        for (k = 0; k < 4; k++) {
+            xmin = min(xmin, quad->v[k].win.x);
+            xmax = max(xmax, quad->v[k].win.x);
+            ymin = min(ymin, quad->v[k].win.y);
+            ymax = max(ymax, quad->v[k].win.y);
+        }
+        if (xmax < 0 || ymax < 0 || xmin >= ctx->w || ymin >= ctx->h)
+            continue;
+        tx0 = max(0, (int)xmin / TILE_SIZE);
+        ty0 = max(0, (int)ymin / TILE_SIZE);
+        tx1 = min(ctx->nb_tiles[0] - 1, (int)xmax / TILE_SIZE);
+        ty1 = min(ctx->nb_tiles[1] - 1, (int)ymax / TILE_SIZE);
+        for (y = ty0; y <= ty1; y++)
+        for (x = tx0; x <= tx1; x++)
+            bin_add(&ctx->bins[y * ctx->nb_tiles[0] + x], i);
+    }
+}
+
+static float edge(const vec3_t *a, const vec3_t *b, float x, float y)
+{
+    return (b->x - a->x) * (y - a->y) - (b->y - a->y) * (x - a->x);
+}
+
+// Compute the bump normal, close to what we get with the linear
+// interpolation of the bump texture.
+static vec3_t get_bump(const sr_quad_t *quad, vec2_t uv)
+{
+    int e;
+    float w;
+    vec3_t n0, n1, ret;
+    n0 = vec3(VEC3_SPLIT(FACES_NORMALS[quad->face]));
+    ret = n0;
+    for (e = 0; e < 4; e++) {
+        if (!(quad->borders_mask & (1 << e))) continue;
+        switch (e) {
+            case 0: w = 1 - clamp(uv.y * 15, 0, 1); break;
+            case 1: w = clamp(uv.x * 15 - 14, 0, 1); break;
+            case 2: w = clamp(uv.y * 15 - 14, 0, 1); break;
+            default: w = 1 - clamp(uv.x * 15, 0, 1); break;
+        }
+        n1 = vec3(VEC3_SPLIT(
+                    FACES_NORMALS[FACES_NEIGHBORS[quad->face][e]]));
+        ret = vec3_mix(ret, vec3_mul(vec3_add(n0, n1), 0.5), w);
+    }
+    return vec3_normalized(ret);
+}
+
+// Same as the FSHADER, but in world coordinates.
+static vec3_t shade(const sr_ctx_t *ctx, const sr_quad_t *quad,
+                    const float l[3], int tri)
+{
+    const render_settings_t *settings = &ctx->rend->settings;
+    const int ts = VOXEL_TEXTURE_SIZE;
+    int k;
+    const sr_vertex_t *v;
+    vec3_t pos = vec3_zero, normal = vec3_zero, n, s, r, view, ret, o, fn;
+    vec2_t uv = vec2(0, 0);
+    float s_dot_n, l_dif, l_amb, l_spe = 0, bshadow, visibility;
+
+    for (k = 0; k < 3; k++) {
+        v = &quad->v[QUAD_TRIS[tri][k]];
+        vec3_iaddk(&pos, v->pos, l[k]);
+        vec3_iaddk(&normal, v->normal, l[k]);
+        uv.x += v->uv.x * l[k];
+        uv.y += v->uv.y * l[k];
+    }
+    uv = vec2(clamp(uv.x, 0, 1), clamp(uv.y, 0, 1));
+
+    s = ctx->light_dir;
+    n = vec3_normalized(normal);
+    n = vec3_mix(get_bump(quad, uv), n, settings->smoothness);
+    s_dot_n = vec3_dot(s, n);
+    l_dif = settings->diffuse * max(0, s_dot_n);
+    l_amb = settings->ambient;
+
+    view = vec3_normalized(vec3_sub(ctx->eye, pos));
+    r = vec3_sub(vec3_mul(n, 2 * s_dot_n), s);
+    if (s_dot_n > 0 && settings->specular > 0)
+        l_spe = settings->specular *
+                pow(max(vec3_dot(r, view), 0), settings->shininess);
+
+    bshadow = render_get_border_dist((uv.x * (ts - 1) + 0.5) / ts,
+                                     (uv.y * (ts - 1) + 0.5) / ts,
+                                     quad->shadow_mask);
+    bshadow = mix(1, sqrt(bshadow), settings->border_shadow);
+
+    ret = vec3_mul(quad->color,
+                   (l_dif + l_amb) * ctx->rend->light.intensity);
+    vec3_iaddk(&ret, vec3(1, 1, 1), l_spe * ctx->rend->light.intensity);
+    vec3_imul(&ret, bshadow);
+
+    if (settings->shadow) {
+        visibility = 1;
+        if (s_dot_n <= 0) {
+            visibility = 0.5;
+        } else {
+            fn = vec3(VEC3_SPLIT(FACES_NORMALS[quad->face]));
+            o = vec3_addk(pos, fn, 0.01);
+            if (mesh_raycast_bounded(ctx->mesh, ctx->bounds[0],
+                                     ctx->bounds[1], &o, &s, INFINITY,
+                                     NULL, NULL, NULL, NULL))
+                visibility = 0.2;
+        }
+        vec3_imul(&ret, mix(1, visibility, settings->shadow));
+    }
+    return ret;
+}
+
+static void render_tile(int tile, void *user)
+{
+    sr_ctx_t *ctx = user;
+    const sr_bin_t *bin = &ctx->bins[tile];
+    const sr_quad_t *quad;
+    const sr_vertex_t *a, *b, *c;
+    int x0, y0, x1, y1, x, y, i, t, k, n, row;
+    int bx0, by0, bx1, by1;
+    float area, px, py, w[3], z, l[3], sum;
+    vec3_t color;
+    uint8_t *out;
+    // Per pixel: the depth, the quad, the triangle and the barycentric
+    // coordinates.
+    float zbuf[TILE_SIZE * TILE_SIZE];
+    int qbuf[TILE_SIZE * TILE_SIZE];
+    uint8_t tbuf[TILE_SIZE * TILE_SIZE];
+    float lbuf[TILE_SIZE * TILE_SIZE][2];
+
+    x0 = (tile % ctx->nb_tiles[0]) * TILE_SIZE;
+    y0 = (tile / ctx->nb_tiles[0]) * TILE_SIZE;
+    x1 = min(x0 + TILE_SIZE, ctx->w);
+    y1 = min(y0 + TILE_SIZE, ctx->h);
+    for (i = 0; i < TILE_SIZE * TILE_SIZE; i++) {
+        zbuf[i] = 1;
+        qbuf[i] = -1;
+    }
+
+    for (i = 0; i < bin->nb; i++) {
+        quad = &ctx->quads[bin->quads[i]];
+        for (t = 0; t < 2; t++) {
+            a = &quad->v[QUAD_TRIS[t][0]];
+            b = &quad->v[QUAD_TRIS[t][1]];
+            c = &quad->v[QUAD_TRIS[t][2]];
+            area = edge(&a->win, &b->win, c->win.x, c->win.y);
+            if (area <= 0) continue; // Back face culling.
+            bx0 = max(x0, (int)floor(min3(a->win.x, b->win.x, c->win.x)));
+            by0 = max(y0, (int)floor(min3(a->win.y, b->win.y, c->win.y)));
+            bx1 = min(x1, (int)ceil(max3(a->win.x, b->win.x, c->win.x)));
+            by1 = min(y1, (int)ceil(max3(a->win.y, b->win.y, c->win.y)));
+            for (y = by0; y < by1; y++)
+            for (x = bx0; x < bx1; x++) {
+                px = x + 0.5;
+                py = y + 0.5;
+                w[0] = edge(&b->win, &c->win, px, py);
+                w[1] = edge(&c->win, &a->win, px, py);
+                w[2] = edge(&a->win, &b->win, px, py);
+                if (w[0] < 0 || w[1] < 0 || w[2] < 0) continue;
+                z = (w[0] * a->win.z + w[1] * b->win.z + w[2] * c->win.z) /
+                    area;
+                k = (y - y0) * TILE_SIZE + (x - x0);
+                if (z < 0 || z >= zbuf[k]) continue;
+                zbuf[k] = z;
+                qbuf[k] = bin->quads[i];
+                tbuf[k] = t;
+                lbuf[k][0] = w[0] / area;
+                lbuf[k][1] = w[1] / area;
+            }
+        }
+    }
+
+    for (y = y0; y < y1; y++)
+    for (x = x0; x < x1; x++) {
+        k = (y - y0) * TILE_SIZE + (x - x0);
+        if (qbuf[k] == -1) continue;
+        quad = &ctx->quads[qbuf[k]];
+        t = tbuf[k];
+        // Perspective correct barycentric coordinates.
+        l[0] = lbuf[k][0];
+        l[1] = lbuf[k][1];
+        l[2] = 1 - l[0] - l[1];
+        sum = 0;
+        for (n = 0; n < 3; n++) {
+            l[n] *= quad->v[QUAD_TRIS[t][n]].iw;
+            sum += l[n];
+        }
+        for (n = 0; n < 3; n++) l[n] /= sum;
+        color = shade(ctx, quad, l, t);
+        row = ctx->h - y - 1;
+        out = &ctx->out[((size_t)row * ctx->w + x) * 4];
+        out[0] = clamp(color.r, 0, 1) * 255;
+        out[1] = clamp(color.g, 0, 1) * 255;
+        out[2] = clamp(color.b, 0, 1) * 255;
+        out[3] = 255;
+    }
+}
+
+void render_soft(const renderer_t *rend, const mesh_t *mesh,
+                 int w, int h, uint8_t *out)
+{
+    sr_ctx_t ctx = {
+        .rend = rend,
+        .mesh = mesh,
+        .w = w,
+        .h = h,
+        .out = out,
+    };
+    block_t *block;
+    int i, nb_blocks;
+
+    ctx.effects = (rend->settings.effects | EFFECT_SMOOTH) &
+                  (EFFECT_BORDERS | EFFECT_BORDERS_ALL | EFFECT_SMOOTH);
+    if (rend->settings.effects & EFFECT_SMOOTH_MESH)
+        LOG_W("Smooth meshes not supported by the software renderer");
+    ctx.mvp = mat4_mul(rend->proj_mat, rend->view_mat);
+    ctx.eye = mat4_mul_vec3(mat4_inverted(rend->view_mat), vec3_zero);
+    ctx.light_dir = render_get_light_dir(rend);
+    mesh_get_blocks_bounds(mesh, ctx.bounds[0], ctx.bounds[1]);
+    memset(out, 0, (size_t)w * h * 4);
+
+    nb_blocks = HASH_COUNT(mesh->blocks);
+    ctx.blocks = calloc(nb_blocks, sizeof(*ctx.blocks));
+    ctx.blocks_quads = calloc(nb_blocks, sizeof(*ctx.blocks_quads));
+    ctx.blocks_nb_quads = calloc(nb_blocks, sizeof(*ctx.blocks_nb_quads));
+    nb_blocks = 0;
+    MESH_ITER_BLOCKS(mesh, block) {
+        if (!block_is_hidden(block)) ctx.blocks[nb_blocks++] = block;
+    }
+    parallel_for(nb_blocks, generate_block_quads, &ctx);
+
+    for (i = 0; i < nb_blocks; i++)
+        ctx.nb_quads += ctx.blocks_nb_quads[i];
+    ctx.quads = calloc(max(ctx.nb_quads, 1), sizeof(*ctx.quads));
+    ctx.nb_quads = 0;
+    for (i = 0; i < nb_blocks; i++) {
+        memcpy(ctx.quads + ctx.nb_quads, ctx.blocks_quads[i],
+               ctx.blocks_nb_quads[i] * sizeof(*ctx.quads));
+        ctx.nb_quads += ctx.blocks_nb_quads[i];
+        free(ctx.blocks_quads[i]);
+    }
+
+    ctx.nb_tiles[0] = (w + TILE_SIZE - 1) / TILE_SIZE;
+    ctx.nb_tiles[1] = (h + TILE_SIZE - 1) / TILE_SIZE;
+    ctx.bins = calloc(ctx.nb_tiles[0] * ctx.nb_tiles[1], sizeof(*ctx.bins));
+    bin_quads(&ctx);
+    parallel_for(ctx.nb_tiles[0] * ctx.nb_tiles[1], render_tile, &ctx);
+
+    for (i = 0; i < ctx.nb_tiles[0] * ctx.nb_tiles[1]; i++)
+        free(ctx.bins[i].quads);
+    free(ctx.bins);
+    free(ctx.quads);
+    free(ctx.blocks);
+    free(ctx.blocks_quads);
+    free(ctx.blocks_nb_quads);
+}
@@ -168,8 +168,11 @@ texture_t *texture_new_image(const char *path, int flags)
     tex->h = h;
     tex->flags = TF_HAS_TEX | flags;
     tex->format = (int[]){0, 0, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA}[bpp];
-    texture_create_empty(tex);
-    texture_set_data(tex, img, w, h, bpp);
+    // Without OpenGL context we only keep the path and size of the image.
+    if (!goxel->headless) {
+        texture_create_empty(tex);
+        texture_set_data(tex, img, w, h, bpp);
+    }
     free(img);
     tex->ref = 1;
     LL_APPEND(g_textures, tex);
@@ -54,6 +54,7 @@ void tool_register_(const tool_t *tool)
 int tool_iter(int tool, const inputs_t *inputs, int state, void **data,
               const vec4_t *view, bool inside)
 {
+    PROFILED;
     int ret;
     assert(tool >= 0 && tool < TOOL_COUNT);
     assert(g_tools[tool]->iter_fn);
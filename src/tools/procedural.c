@@ -29,6 +29,15 @@ enum {
     STATE_ENTER     = 0x0100,
 };
 
+// Mesh modified by the procedural thread.
+static mesh_t *g_target = NULL;
+
+// The state can be changed by the procedural thread.
+static int get_state(const gox_proc_t *proc)
+{
+    return __atomic_load_n(&proc->state, __ATOMIC_ACQUIRE);
+}
+
 static int iter(const inputs_t *inputs, int state, void **data,
                 const vec4_t *view, bool inside)
 {
@@ -38,7 +47,7 @@ static int iter(const inputs_t *inputs, int state, void **data,
     gox_proc_t *proc = &goxel->proc;
     const bool down = inputs->mouse_down[0];
 
-    if (proc->state == PROC_PARSE_ERROR) return 0;
+    if (get_state(proc) == PROC_PARSE_ERROR) return 0;
 
     // XXX: duplicate code with tool_brush_iter.
     if (inside)
@@ -66,6 +75,7 @@ static int iter(const inputs_t *inputs, int state, void **data,
         if (down) {
             image_history_push(goxel->image);
             proc_stop(proc);
+            proc_sync(proc, goxel->image->active_layer->mesh);
             proc_start(proc, &box);
             return STATE_PAINT;
         }
@@ -97,8 +107,11 @@ static int gui(void)
     int i;
     static int current = -1;
     gox_proc_t *proc = &goxel->proc;
+    mesh_t *mesh = goxel->image->active_layer->mesh;
     bool enabled;
     static bool auto_run;
+    static bool clip;
+    static bool instances;
     static int timer = 0;
     static char prog_path[1024];       // "\0" if no loaded prog.
     static char prog_buff[64 * 1024];  // XXX: make it dynamic?
@@ -123,19 +136,20 @@ static int gui(void)
         timer = 0;
         proc_parse(prog_buff, proc);
     }
-    if (proc->error.str) {
+    // The error string can be changed by the thread.
+    if (proc->error.str && !proc->thread) {
         gui_input_text_multiline_highlight(goxel->proc.error.line);
         gui_text(proc->error.str);
     }
-    enabled = proc->state >= PROC_READY;
+    enabled = get_state(proc) >= PROC_READY;
 
-    if (auto_run && proc->state == PROC_READY && timer == 0) timer = 1;
-    if (proc->state == PROC_RUNNING) {
+    if (auto_run && get_state(proc) == PROC_READY && timer == 0) timer = 1;
+    if (get_state(proc) == PROC_RUNNING) {
         if (gui_button("Stop", 0)) proc_stop(proc);
     } else {
         gui_enabled_begin(enabled);
         if (    (gui_button("Run", 0) && enabled) ||
-                (auto_run && proc->state == PROC_READY &&
+                (auto_run && get_state(proc) == PROC_READY &&
                  timer && timer++ >= 16)) {
             mesh_clear(goxel->image->active_layer->mesh);
             proc_start(proc, NULL);
@@ -147,6 +161,14 @@ static int gui(void)
     if (gui_checkbox("Auto", &auto_run, NULL))
         proc_parse(prog_buff, proc);
     gui_same_line();
+    gui_checkbox("Clip", &clip, "Only generate inside the image box");
+    proc->options.clip.enabled = clip && !box_is_null(goxel->image->box);
+    proc->options.clip.box = goxel->image->box;
+    gui_same_line();
+    gui_checkbox("Instances", &instances,
+                 "Voxelize the repeated invariant shapes only once");
+    proc->options.instancing = instances;
+    gui_same_line();
 
     if (gui_button("Export Animation", 0)) {
         const char *dir_path;
@@ -200,24 +222,49 @@ static int gui(void)
         proc_parse(prog_buff, proc);
     }
 
-    if (proc->state == PROC_RUNNING && prog_export_animation
+    if (get_state(proc) == PROC_RUNNING && prog_export_animation
             && !proc->in_frame) {
         char path[1024];
         sprintf(path, "%s/img_%04d.png",
                 prog_export_animation_path, proc->frame);
         action_exec2("export_as", "pp", "png", path);
     }
-    if (proc->state != PROC_RUNNING) prog_export_animation = false;
+    if (get_state(proc) != PROC_RUNNING) prog_export_animation = false;
 
-    if (proc->state == PROC_RUNNING) {
-        proc_iter(proc);
-        if (!proc->in_frame)
-            goxel_update_meshes(goxel, MESH_LAYERS);
+    // Run the program in a thread, except for the animations export since
+    // we need to save the image after each frame.
+    if (get_state(proc) == PROC_RUNNING && !proc->thread) {
+        g_target = mesh;
+        if (prog_export_animation || proc_run_async(proc, mesh) != 0) {
+            proc_iter(proc);
+            if (!proc->in_frame)
+                goxel_update_meshes(goxel, MESH_LAYERS);
+        }
     }
+    // Stop if the active layer changed.
+    if (proc->thread && mesh != g_target) {
+        proc_stop(proc);
+        proc_sync(proc, NULL);
+    }
+    if (proc_sync(proc, mesh))
+        goxel_update_meshes(goxel, MESH_LAYERS);
+    return 0;
+}
+
+// Called when we change the tool, and before the actions that modify the
+// image: stop the thread and keep what it generated so far, so that it
+// doesn't overwrite the other changes later.
+static int cancel(int state, void **data)
+{
+    gox_proc_t *proc = &goxel->proc;
+    if (!proc->thread) return 0;
+    proc_stop(proc);
+    proc_sync(proc, g_target);
     return 0;
 }
 
 TOOL_REGISTER(TOOL_PROCEDURAL, procedural,
               .gui_fn = gui,
               .iter_fn = iter,
+              .cancel_fn = cancel,
 )
@@ -24,6 +24,16 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <unistd.h>
+#ifndef __EMSCRIPTEN__
+#   include <pthread.h>
+#endif
+#ifndef WIN32
+#   include <sys/resource.h>
+#endif
+#ifndef NO_ZLIB
+#   include <zlib.h>
+#endif
 
 // Prevent warnings in stb code.
 #ifdef __GNUC__
@@ -313,6 +323,189 @@ uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp, int *size)
     return stbi_write_png_to_mem((void*)img, 0, w, h, bpp, size);
 }
 
+/*
+ * Streaming png writer, so that we can save images without having them
+ * entirely in memory.  Each row uses the 'sub' filter.  If we don't have
+ * zlib, we write uncompressed (stored) deflate blocks instead.
+ */
+#define PNG_OUT_SIZE (256 * 1024)
+
+struct png_writer {
+    FILE        *file;
+    int         w, h, bpp;
+    int         row;        // Number of rows written so far.
+    uint8_t     *filtered;  // The current filtered row.
+    uint8_t     *out;       // Deflate output buffer.
+#ifndef NO_ZLIB
+    z_stream    z;
+#else
+    uint32_t    adler;
+#endif
+};
+
+#ifdef NO_ZLIB
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static uint32_t table[256];
+    uint32_t c;
+    int i, k;
+    if (!table[1]) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (size--) crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+#endif
+
+static void png_write_u32(uint8_t *out, uint32_t v)
+{
+    out[0] = v >> 24;
+    out[1] = v >> 16;
+    out[2] = v >> 8;
+    out[3] = v;
+}
+
+static void png_write_chunk(png_writer_t *png, const char *type,
+                            const uint8_t *data, int size)
+{
+    uint8_t buf[4];
+    uint32_t crc;
+    png_write_u32(buf, size);
+    fwrite(buf, 4, 1, png->file);
+    fwrite(type, 4, 1, png->file);
+    if (size) fwrite(data, size, 1, png->file);
+    crc = crc32(0, (const uint8_t*)type, 4);
+    if (size) crc = crc32(crc, data, size);
+    png_write_u32(buf, crc);
+    fwrite(buf, 4, 1, png->file);
+}
+
+// Compress some data and put the result into IDAT chunks.
+static void png_deflate(png_writer_t *png, const uint8_t *data, int size,
+                        bool finish)
+{
+#ifndef NO_ZLIB
+    int ret;
+    png->z.next_in = (uint8_t*)data;
+    png->z.avail_in = size;
+    do {
+        png->z.next_out = png->out;
+        png->z.avail_out = PNG_OUT_SIZE;
+        ret = deflate(&png->z, finish ? Z_FINISH : Z_NO_FLUSH);
+        assert(ret != Z_STREAM_ERROR);
+        if (png->z.avail_out < PNG_OUT_SIZE)
+            png_write_chunk(png, "IDAT", png->out,
+                            PNG_OUT_SIZE - png->z.avail_out);
+    } while (png->z.avail_out == 0 || (finish && ret != Z_STREAM_END));
+#else
+    uint8_t *out = png->out;
+    int i, n;
+    uint32_t a = png->adler & 0xffff, b = png->adler >> 16;
+    for (i = 0; i < size; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    png->adler = (b << 16) | a;
+    // Stored blocks of at most 65535 bytes.
+    do {
+        n = min(size, 65535);
+        out[0] = (finish && n == size) ? 1 : 0;
+        out[1] = n & 0xff;
+        out[2] = n >> 8;
+        out[3] = ~n & 0xff;
+        out[4] = (~n >> 8) & 0xff;
+        if (n) memcpy(out + 5, data, n);
+        if (finish && n == size) png_write_u32(out + 5 + n, png->adler);
+        png_write_chunk(png, "IDAT", out,
+                        5 + n + ((finish && n == size) ? 4 : 0));
+        data += n;
+        size -= n;
+    } while (size);
+#endif
+}
+
+png_writer_t *png_writer_create(const char *path, int w, int h, int bpp)
+{
+    const uint8_t SIGNATURE[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    const uint8_t COLOR_TYPES[5] = {0, 0, 4, 2, 6};
+    uint8_t ihdr[13] = {};
+    png_writer_t *png;
+    FILE *file;
+
+    assert(bpp >= 1 && bpp <= 4);
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot open %s", path);
+        return NULL;
+    }
+    png = calloc(1, sizeof(*png));
+    png->file = file;
+    png->w = w;
+    png->h = h;
+    png->bpp = bpp;
+    png->filtered = malloc(1 + (size_t)w * bpp);
+    png->out = malloc(PNG_OUT_SIZE);
+    fwrite(SIGNATURE, 8, 1, file);
+    png_write_u32(ihdr + 0, w);
+    png_write_u32(ihdr + 4, h);
+    ihdr[8] = 8;    // Bit depth.
+    ihdr[9] = COLOR_TYPES[bpp];
+    png_write_chunk(png, "IHDR", ihdr, 13);
+#ifndef NO_ZLIB
+    // Fast compression: for big images the time is mostly spent in zlib.
+    deflateInit(&png->z, Z_BEST_SPEED);
+#else
+    png->adler = 1;
+    png->out = realloc(png->out, 5 + 65535 + 4);
+    png->out[0] = 0x78; // zlib header.
+    png->out[1] = 0x01;
+    png_write_chunk(png, "IDAT", png->out, 2);
+#endif
+    return png;
+}
+
+void png_writer_write(png_writer_t *png, const uint8_t *rows, int nb)
+{
+    int i, k;
+    const int size = png->w * png->bpp;
+    const uint8_t *row;
+
+    for (i = 0; i < nb && png->row < png->h; i++, png->row++) {
+        row = rows + (size_t)i * size;
+        png->filtered[0] = 1; // Sub filter.
+        for (k = 0; k < size; k++)
+            png->filtered[1 + k] = row[k] - (k >= png->bpp ?
+                                             row[k - png->bpp] : 0);
+        png_deflate(png, png->filtered, 1 + size, false);
+    }
+}
+
+int png_writer_finish(png_writer_t *png)
+{
+    int ret = 0;
+    if (!png) return -1;
+    if (png->row != png->h) {
+        LOG_E("Only %d/%d rows written", png->row, png->h);
+        ret = -1;
+    }
+    png_deflate(png, NULL, 0, true);
+#ifndef NO_ZLIB
+    deflateEnd(&png->z);
+#endif
+    png_write_chunk(png, "IEND", NULL, 0);
+    if (fclose(png->file) != 0) ret = -1;
+    free(png->filtered);
+    free(png->out);
+    free(png);
+    return ret;
+}
+
 bool str_endswith(const char *str, const char *end)
 {
     if (!str || !end) return false;
@@ -380,3 +573,131 @@ vec3_t unproject(const vec3_t *win, const mat4_t *model,
     if (p.w != 0) vec3_imul(&(p.xyz), 1 / p.w);
     return p.xyz;
 }
+
+int get_nb_cpus(void)
+{
+#if defined(_SC_NPROCESSORS_ONLN) && !defined(__EMSCRIPTEN__)
+    return clamp((int)sysconf(_SC_NPROCESSORS_ONLN), 1, 64);
+#else
+    return 1;
+#endif
+}
+
+int64_t get_peak_memory(void)
+{
+#if !defined(WIN32) && !defined(__EMSCRIPTEN__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#   ifdef __APPLE__
+    return usage.ru_maxrss;
+#   else
+    return (int64_t)usage.ru_maxrss * 1024;
+#   endif
+#else
+    return 0;
+#endif
+}
+
+/*
+ * The parallel_for threads are created the first time we need them, and
+ * then wait for some work.  Several threads can call parallel_for at the
+ * same time (for example the procedural thread and the main thread), so we
+ * keep a list of the running loops, and the workers help with the first
+ * one that still has some indices to run.  The calling thread also runs
+ * its own loop, so nested calls work too.
+ */
+
+typedef struct parallel_for parallel_for_t;
+struct parallel_for {
+    parallel_for_t *next, *prev;
+    int n;
+    int next_i;     // Next index to run.
+    int users;      // Number of workers running the loop.
+    void (*f)(int i, void *user);
+    void *user;
+};
+
+static void parallel_for_run(parallel_for_t *p)
+{
+    int i;
+    while ((i = __sync_fetch_and_add(&p->next_i, 1)) < p->n)
+        p->f(i, p->user);
+}
+
+#ifndef __EMSCRIPTEN__
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond;  // Signaled when a loop is added.
+    pthread_cond_t  done_cond;  // Signaled when a worker leaves a loop.
+    parallel_for_t  *loops;
+} g_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+static void *parallel_for_worker(void *arg)
+{
+    parallel_for_t *p;
+    pthread_mutex_lock(&g_pool.lock);
+    while (true) {
+        DL_FOREACH(g_pool.loops, p) {
+            if (__atomic_load_n(&p->next_i, __ATOMIC_RELAXED) < p->n) break;
+        }
+        if (!p) {
+            pthread_cond_wait(&g_pool.work_cond, &g_pool.lock);
+            continue;
+        }
+        p->users++;
+        pthread_mutex_unlock(&g_pool.lock);
+        parallel_for_run(p);
+        pthread_mutex_lock(&g_pool.lock);
+        if (--p->users == 0) pthread_cond_broadcast(&g_pool.done_cond);
+    }
+    return NULL;
+}
+
+static void parallel_for_init(void)
+{
+    int i;
+    pthread_t thread;
+    for (i = 0; i < get_nb_cpus() - 1; i++) {
+        pthread_create(&thread, NULL, parallel_for_worker, NULL);
+        pthread_detach(thread);
+    }
+}
+
+void parallel_for(int n, void (*f)(int i, void *user), void *user)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    parallel_for_t p = {.n = n, .f = f, .user = user};
+
+    if (n <= 1 || get_nb_cpus() == 1) {
+        parallel_for_run(&p);
+        return;
+    }
+    pthread_once(&once, parallel_for_init);
+    pthread_mutex_lock(&g_pool.lock);
+    DL_APPEND(g_pool.loops, &p);
+    pthread_cond_broadcast(&g_pool.work_cond);
+    pthread_mutex_unlock(&g_pool.lock);
+
+    parallel_for_run(&p);
+
+    // Wait for the workers still running the last indices.
+    pthread_mutex_lock(&g_pool.lock);
+    DL_DELETE(g_pool.loops, &p);
+    while (p.users)
+        pthread_cond_wait(&g_pool.done_cond, &g_pool.lock);
+    pthread_mutex_unlock(&g_pool.lock);
+}
+
+#else
+
+void parallel_for(int n, void (*f)(int i, void *user), void *user)
+{
+    parallel_for_t p = {.n = n, .f = f, .user = user};
+    parallel_for_run(&p);
+}
+
+#endif